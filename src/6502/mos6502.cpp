@@ -11,23 +11,28 @@ namespace mos6502 {
 #define ZERO 0x02
 #define CARRY 0x01
 
-#define SET_NEGATIVE(x) (x ? (status |= NEGATIVE) : (status &= (~NEGATIVE)))
-#define SET_OVERFLOW(x) (x ? (status |= OVERFLOW) : (status &= (~OVERFLOW)))
+// N and Z are evaluated lazily from nz: Z is set if its low byte is zero and N
+// is bit 15. C and V are kept in their own variables, and all four are only
+// merged into the status byte when it is read
+#define SET_NEGATIVE(x) (nz = (nz & 0x00FF) | ((x) ? 0x8000 : 0))
+#define SET_OVERFLOW(x) (overflow = (x) ? true : false)
 #define SET_CONSTANT(x) (x ? (status |= CONSTANT) : (status &= (~CONSTANT)))
 #define SET_BREAK(x) (x ? (status |= BREAK) : (status &= (~BREAK)))
 #define SET_DECIMAL(x) (x ? (status |= DECIMAL) : (status &= (~DECIMAL)))
 #define SET_INTERRUPT(x) (x ? (status |= INTERRUPT) : (status &= (~INTERRUPT)))
-#define SET_ZERO(x) (x ? (status |= ZERO) : (status &= (~ZERO)))
-#define SET_CARRY(x) (x ? (status |= CARRY) : (status &= (~CARRY)))
+#define SET_ZERO(x) (nz = (nz & 0xFF00) | ((x) ? 0 : 1))
+#define SET_CARRY(x) (carry = (x) ? true : false)
+// Set N and Z from an 8 bit result
+#define SET_NZ(x) (nz = uint8_t(x) | ((uint16_t(x) & 0x80) << 8))
 
-#define IF_NEGATIVE() ((status & NEGATIVE) ? true : false)
-#define IF_OVERFLOW() ((status & OVERFLOW) ? true : false)
+#define IF_NEGATIVE() ((nz & 0x8000) ? true : false)
+#define IF_OVERFLOW() (overflow)
 #define IF_CONSTANT() ((status & CONSTANT) ? true : false)
 #define IF_BREAK() ((status & BREAK) ? true : false)
 #define IF_DECIMAL() ((status & DECIMAL) ? true : false)
 #define IF_INTERRUPT() ((status & INTERRUPT) ? true : false)
-#define IF_ZERO() ((status & ZERO) ? true : false)
-#define IF_CARRY() ((status & CARRY) ? true : false)
+#define IF_ZERO() ((nz & 0x00FF) == 0)
+#define IF_CARRY() (carry)
 
 mos6502::mos6502(BusRead r, BusWrite w) {
   Write = (BusWrite)w;
@@ -552,11 +557,30 @@ mos6502::mos6502(BusRead r, BusWrite w) {
   instr.code = &mos6502::Op_TYA;
   InstrTable[0x98] = instr;
 
+  for (int i = 0; i < 256; i++) {
+    AddrExec a = InstrTable[i].addr;
+    if (a == &mos6502::Addr_ABS || a == &mos6502::Addr_ABX ||
+        a == &mos6502::Addr_ABY || a == &mos6502::Addr_ABI)
+      InstrOperands[i] = 2;
+    else if (a == &mos6502::Addr_IMP || a == &mos6502::Addr_ACC)
+      InstrOperands[i] = 0;
+    else
+      InstrOperands[i] = 1;
+  }
+
   // Reset();
 
   return;
 }
 
+uint8_t mos6502::FetchOperand() {
+  if (operandPtr != nullptr) {
+    pc++;
+    return *(operandPtr++);
+  }
+  return Read(pc++);
+}
+
 uint16_t mos6502::Addr_ACC() {
   return 0; // not used
 }
@@ -568,15 +592,15 @@ uint16_t mos6502::Addr_ABS() {
   uint16_t addrH;
   uint16_t addr;
 
-  addrL = Read(pc++);
-  addrH = Read(pc++);
+  addrL = FetchOperand();
+  addrH = FetchOperand();
 
   addr = addrL + (addrH << 8);
 
   return addr;
 }
 
-uint16_t mos6502::Addr_ZER() { return Read(pc++); }
+uint16_t mos6502::Addr_ZER() { return FetchOperand(); }
 
 uint16_t mos6502::Addr_IMP() {
   return 0; // not used
@@ -586,7 +610,7 @@ uint16_t mos6502::Addr_REL() {
   uint16_t offset;
   uint16_t addr;
 
-  offset = (uint16_t)Read(pc++);
+  offset = (uint16_t)FetchOperand();
   if (offset & 0x80)
     offset |= 0xFF00;
   addr = pc + (int16_t)offset;
@@ -601,8 +625,8 @@ uint16_t mos6502::Addr_ABI() {
   uint16_t abs;
   uint16_t addr;
 
-  addrL = Read(pc++);
-  addrH = Read(pc++);
+  addrL = FetchOperand();
+  addrH = FetchOperand();
 
   abs = (addrH << 8) | addrL;
 
@@ -615,12 +639,12 @@ uint16_t mos6502::Addr_ABI() {
 }
 
 uint16_t mos6502::Addr_ZEX() {
-  uint16_t addr = (Read(pc++) + X) % 256;
+  uint16_t addr = (FetchOperand() + X) % 256;
   return addr;
 }
 
 uint16_t mos6502::Addr_ZEY() {
-  uint16_t addr = (Read(pc++) + Y) % 256;
+  uint16_t addr = (FetchOperand() + Y) % 256;
   return addr;
 }
 
@@ -629,8 +653,8 @@ uint16_t mos6502::Addr_ABX() {
   uint16_t addrL;
   uint16_t addrH;
 
-  addrL = Read(pc++);
-  addrH = Read(pc++);
+  addrL = FetchOperand();
+  addrH = FetchOperand();
 
   addr = addrL + (addrH << 8) + X;
   return addr;
@@ -641,8 +665,8 @@ uint16_t mos6502::Addr_ABY() {
   uint16_t addrL;
   uint16_t addrH;
 
-  addrL = Read(pc++);
-  addrH = Read(pc++);
+  addrL = FetchOperand();
+  addrH = FetchOperand();
 
   addr = addrL + (addrH << 8) + Y;
   return addr;
@@ -653,7 +677,7 @@ uint16_t mos6502::Addr_INX() {
   uint16_t zeroH;
   uint16_t addr;
 
-  zeroL = (Read(pc++) + X) % 256;
+  zeroL = (FetchOperand() + X) % 256;
   zeroH = (zeroL + 1) % 256;
   addr = Read(zeroL) + (Read(zeroH) << 8);
 
@@ -665,7 +689,7 @@ uint16_t mos6502::Addr_INY() {
   uint16_t zeroH;
   uint16_t addr;
 
-  zeroL = Read(pc++);
+  zeroL = FetchOperand();
   zeroH = (zeroL + 1) % 256;
   addr = Read(zeroL) + (Read(zeroH) << 8) + Y;
 
@@ -680,8 +704,7 @@ void mos6502::Reset() {
   pc = (Read(rstVectorH) << 8) + Read(rstVectorL); // load PC from reset vector
 
   sp = 0xFD;
-  status = 0;
-  status |= CONSTANT;
+  SetStatus(CONSTANT);
 
   cycles =
       6; // according to the datasheet, the reset routine takes 6 clock cycles
@@ -691,6 +714,27 @@ void mos6502::Reset() {
   return;
 }
 
+uint8_t mos6502::GetStatus() {
+  uint8_t s = status & ~(NEGATIVE | OVERFLOW | ZERO | CARRY);
+  if (IF_NEGATIVE())
+    s |= NEGATIVE;
+  if (IF_OVERFLOW())
+    s |= OVERFLOW;
+  if (IF_ZERO())
+    s |= ZERO;
+  if (IF_CARRY())
+    s |= CARRY;
+  return s;
+}
+
+void mos6502::SetStatus(uint8_t s) {
+  status = s;
+  SET_NEGATIVE(s & NEGATIVE);
+  SET_OVERFLOW(s & OVERFLOW);
+  SET_ZERO(s & ZERO);
+  SET_CARRY(s & CARRY);
+}
+
 void mos6502::StackPush(uint8_t byte) {
   Write(0x0100 + sp, byte);
   if (sp == 0x00)
@@ -712,45 +756,130 @@ void mos6502::IRQ(uint16_t vectorH, uint16_t vectorL) {
     SET_BREAK(0);
     StackPush((pc >> 8) & 0xFF);
     StackPush(pc & 0xFF);
-    StackPush(status);
+    StackPush(GetStatus());
     SET_INTERRUPT(1);
     pc = (Read(vectorH) << 8) + Read(vectorL);
   }
   return;
 }
 
+void mos6502::SetIRQVector(int line, uint16_t vectorH, uint16_t vectorL) {
+  irqVectorH[line] = vectorH;
+  irqVectorL[line] = vectorL;
+}
+
+void mos6502::SetIRQLine(int line, bool asserted) {
+  if (asserted)
+    irqPending |= (1UL << line);
+  else
+    irqPending &= ~(1UL << line);
+}
+
+void mos6502::ServiceIRQ() {
+  int line = 0;
+  while (!(irqPending & (1UL << line)))
+    line++;
+  IRQ(irqVectorH[line], irqVectorL[line]);
+}
+
 void mos6502::NMI() {
   SET_BREAK(0);
   StackPush((pc >> 8) & 0xFF);
   StackPush(pc & 0xFF);
-  StackPush(status);
+  StackPush(GetStatus());
   SET_INTERRUPT(1);
   pc = (Read(nmiVectorH) << 8) + Read(nmiVectorL);
   return;
 }
 
+uint8_t mos6502::DecodeOpcode(uint8_t opcode) {
+  if (scramble /*&& (pc >= 0x2000)*/) {
+    int b2 = (opcode & 0x04) >> 2;
+    int b7 = (opcode & 0x80) >> 7;
+    opcode = opcode & 0x7B;
+    opcode |= (b2 << 7);
+    opcode |= (b7 << 2);
+  }
+  return opcode;
+}
+
+void mos6502::EnableDecodeCache(const uint32_t *gen, uint16_t first,
+                                bool check) {
+  codeGen = gen;
+  cacheFirst = first;
+  cacheCheck = check;
+  DecodedInstr empty;
+  empty.gen = *gen - 1;
+  decodeCache.assign(0x10000 - first, empty);
+}
+
+void mos6502::DisableDecodeCache() {
+  codeGen = nullptr;
+  decodeCache.clear();
+}
+
+const mos6502::DecodedInstr *mos6502::Decode() {
+  DecodedInstr &d = decodeCache[pc - cacheFirst];
+  int len = 0;
+  if (d.gen == *codeGen) {
+    cacheHits++;
+    if (!cacheCheck)
+      return &d;
+    bool ok = DecodeOpcode(Read(pc)) == d.opcode;
+    len = InstrOperands[d.opcode];
+    for (int i = 0; i < len; i++)
+      ok = ok && (Read(pc + 1 + i) == d.operand[i]);
+    if (!ok) {
+      cout << "decode cache mismatch at pc=" << hex << pc << " cached "
+           << int(d.opcode) << endl;
+      assert(false);
+    }
+    return &d;
+  }
+  cacheMisses++;
+  d.opcode = DecodeOpcode(Read(pc));
+  len = InstrOperands[d.opcode];
+  // Instructions running off the end of the address space aren't cached
+  if (uint32_t(pc) + len > 0xFFFF) {
+    d.gen = *codeGen - 1;
+    return nullptr;
+  }
+  for (int i = 0; i < len; i++)
+    d.operand[i] = Read(pc + 1 + i);
+  d.gen = *codeGen;
+  return &d;
+}
+
 void mos6502::Run(uint32_t n) {
   uint32_t start = cycles;
   uint8_t opcode;
   Instr instr;
 
   while (start + n > cycles && !illegalOpcode) {
-    // fetch
-    opcode = Read(pc++);
-    if (scramble /*&& (pc >= 0x2000)*/) {
-      int b2 = (opcode & 0x04) >> 2;
-      int b7 = (opcode & 0x80) >> 7;
-      opcode = opcode & 0x7B;
-      opcode |= (b2 << 7);
-      opcode |= (b7 << 2);
+    if (irqPending && !IF_INTERRUPT())
+      ServiceIRQ();
+
+    const DecodedInstr *d = nullptr;
+    if (codeGen != nullptr && pc >= cacheFirst)
+      d = Decode();
+
+    if (d != nullptr) {
+      // execute from the cache
+      pc++;
+      operandPtr = d->operand;
+      Exec(InstrTable[d->opcode]);
+      operandPtr = nullptr;
+    } else {
+      // fetch
+      opcode = DecodeOpcode(Read(pc++));
+
+      // decode
+      instr = InstrTable[opcode];
+
+      // execute
+      Exec(instr);
     }
 
-    // decode
-    instr = InstrTable[opcode];
-
-    // execute
-    Exec(instr);
-
     if (illegalOpcode) {
       cout << "illegal at pc=" << hex << (pc - 1) << endl;
       assert(false);
@@ -793,8 +922,7 @@ void mos6502::Op_ADC(uint16_t src) {
 void mos6502::Op_AND(uint16_t src) {
   uint8_t m = Read(src);
   uint8_t res = m & A;
-  SET_NEGATIVE(res & 0x80);
-  SET_ZERO(!res);
+  SET_NZ(res);
   A = res;
   return;
 }
@@ -804,8 +932,7 @@ void mos6502::Op_ASL(uint16_t src) {
   SET_CARRY(m & 0x80);
   m <<= 1;
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Write(src, m);
   return;
 }
@@ -815,8 +942,7 @@ void mos6502::Op_ASL_ACC(uint16_t src) {
   SET_CARRY(m & 0x80);
   m <<= 1;
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
@@ -845,8 +971,8 @@ void mos6502::Op_BEQ(uint16_t src) {
 void mos6502::Op_BIT(uint16_t src) {
   uint8_t m = Read(src);
   uint8_t res = m & A;
-  SET_NEGATIVE(res & 0x80);
-  status = (status & 0x3F) | (uint8_t)(m & 0xC0);
+  SET_NEGATIVE(m & 0x80);
+  SET_OVERFLOW(m & 0x40);
   SET_ZERO(!res);
   return;
 }
@@ -878,7 +1004,7 @@ void mos6502::Op_BRK(uint16_t src) {
   pc++;
   StackPush((pc >> 8) & 0xFF);
   StackPush(pc & 0xFF);
-  StackPush(status | BREAK);
+  StackPush(GetStatus() | BREAK);
   SET_INTERRUPT(1);
   pc = (Read(brkVectorH) << 8) + Read(brkVectorL);
   return;
@@ -921,32 +1047,28 @@ void mos6502::Op_CLV(uint16_t src) {
 void mos6502::Op_CMP(uint16_t src) {
   unsigned int tmp = A - Read(src);
   SET_CARRY(tmp < 0x100);
-  SET_NEGATIVE(tmp & 0x80);
-  SET_ZERO(!(tmp & 0xFF));
+  SET_NZ(tmp);
   return;
 }
 
 void mos6502::Op_CPX(uint16_t src) {
   unsigned int tmp = X - Read(src);
   SET_CARRY(tmp < 0x100);
-  SET_NEGATIVE(tmp & 0x80);
-  SET_ZERO(!(tmp & 0xFF));
+  SET_NZ(tmp);
   return;
 }
 
 void mos6502::Op_CPY(uint16_t src) {
   unsigned int tmp = Y - Read(src);
   SET_CARRY(tmp < 0x100);
-  SET_NEGATIVE(tmp & 0x80);
-  SET_ZERO(!(tmp & 0xFF));
+  SET_NZ(tmp);
   return;
 }
 
 void mos6502::Op_DEC(uint16_t src) {
   uint8_t m = Read(src);
   m = (m - 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Write(src, m);
   return;
 }
@@ -954,8 +1076,7 @@ void mos6502::Op_DEC(uint16_t src) {
 void mos6502::Op_DEX(uint16_t src) {
   uint8_t m = X;
   m = (m - 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
   return;
 }
@@ -963,8 +1084,7 @@ void mos6502::Op_DEX(uint16_t src) {
 void mos6502::Op_DEY(uint16_t src) {
   uint8_t m = Y;
   m = (m - 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Y = m;
   return;
 }
@@ -972,32 +1092,28 @@ void mos6502::Op_DEY(uint16_t src) {
 void mos6502::Op_EOR(uint16_t src) {
   uint8_t m = Read(src);
   m = A ^ m;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
 }
 
 void mos6502::Op_INC(uint16_t src) {
   uint8_t m = Read(src);
   m = (m + 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Write(src, m);
 }
 
 void mos6502::Op_INX(uint16_t src) {
   uint8_t m = X;
   m = (m + 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
 }
 
 void mos6502::Op_INY(uint16_t src) {
   uint8_t m = Y;
   m = (m + 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Y = m;
 }
 
@@ -1012,22 +1128,19 @@ void mos6502::Op_JSR(uint16_t src) {
 
 void mos6502::Op_LDA(uint16_t src) {
   uint8_t m = Read(src);
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
 }
 
 void mos6502::Op_LDX(uint16_t src) {
   uint8_t m = Read(src);
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
 }
 
 void mos6502::Op_LDY(uint16_t src) {
   uint8_t m = Read(src);
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Y = m;
 }
 
@@ -1035,8 +1148,7 @@ void mos6502::Op_LSR(uint16_t src) {
   uint8_t m = Read(src);
   SET_CARRY(m & 0x01);
   m >>= 1;
-  SET_NEGATIVE(0);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Write(src, m);
 }
 
@@ -1044,8 +1156,7 @@ void mos6502::Op_LSR_ACC(uint16_t src) {
   uint8_t m = A;
   SET_CARRY(m & 0x01);
   m >>= 1;
-  SET_NEGATIVE(0);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
 }
 
@@ -1054,8 +1165,7 @@ void mos6502::Op_NOP(uint16_t src) { return; }
 void mos6502::Op_ORA(uint16_t src) {
   uint8_t m = Read(src);
   m = A | m;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
 }
 
@@ -1065,19 +1175,18 @@ void mos6502::Op_PHA(uint16_t src) {
 }
 
 void mos6502::Op_PHP(uint16_t src) {
-  StackPush(status | BREAK);
+  StackPush(GetStatus() | BREAK);
   return;
 }
 
 void mos6502::Op_PLA(uint16_t src) {
   A = StackPop();
-  SET_NEGATIVE(A & 0x80);
-  SET_ZERO(!A);
+  SET_NZ(A);
   return;
 }
 
 void mos6502::Op_PLP(uint16_t src) {
-  status = StackPop();
+  SetStatus(StackPop());
   SET_CONSTANT(1);
   return;
 }
@@ -1089,8 +1198,7 @@ void mos6502::Op_ROL(uint16_t src) {
     m |= 0x01;
   SET_CARRY(m > 0xFF);
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Write(src, m);
   return;
 }
@@ -1102,8 +1210,7 @@ void mos6502::Op_ROL_ACC(uint16_t src) {
     m |= 0x01;
   SET_CARRY(m > 0xFF);
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
@@ -1115,8 +1222,7 @@ void mos6502::Op_ROR(uint16_t src) {
   SET_CARRY(m & 0x01);
   m >>= 1;
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Write(src, m);
   return;
 }
@@ -1128,8 +1234,7 @@ void mos6502::Op_ROR_ACC(uint16_t src) {
   SET_CARRY(m & 0x01);
   m >>= 1;
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
@@ -1137,7 +1242,7 @@ void mos6502::Op_ROR_ACC(uint16_t src) {
 void mos6502::Op_RTI(uint16_t src) {
   uint8_t lo, hi;
 
-  status = StackPop();
+  SetStatus(StackPop());
 
   lo = StackPop();
   hi = StackPop();
@@ -1159,8 +1264,7 @@ void mos6502::Op_RTS(uint16_t src) {
 void mos6502::Op_SBC(uint16_t src) {
   uint8_t m = Read(src);
   unsigned int tmp = A - m - (IF_CARRY() ? 0 : 1);
-  SET_NEGATIVE(tmp & 0x80);
-  SET_ZERO(!(tmp & 0xFF));
+  SET_NZ(tmp);
   SET_OVERFLOW(((A ^ tmp) & 0x80) && ((A ^ m) & 0x80));
 
   if (IF_DECIMAL()) {
@@ -1207,32 +1311,28 @@ void mos6502::Op_STY(uint16_t src) {
 
 void mos6502::Op_TAX(uint16_t src) {
   uint8_t m = A;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
   return;
 }
 
 void mos6502::Op_TAY(uint16_t src) {
   uint8_t m = A;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Y = m;
   return;
 }
 
 void mos6502::Op_TSX(uint16_t src) {
   uint8_t m = sp;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
   return;
 }
 
 void mos6502::Op_TXA(uint16_t src) {
   uint8_t m = X;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
@@ -1244,11 +1344,51 @@ void mos6502::Op_TXS(uint16_t src) {
 
 void mos6502::Op_TYA(uint16_t src) {
   uint8_t m = Y;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
 
 uint16_t mos6502::GetPC() { return pc; }
+
+mos6502::State mos6502::GetState() {
+  State s;
+  s.A = A;
+  s.X = X;
+  s.Y = Y;
+  s.sp = sp;
+  s.status = GetStatus();
+  s.pc = pc;
+  s.irqLines = irqPending;
+  return s;
+}
+
+void mos6502::SetState(const State &s) {
+  A = s.A;
+  X = s.X;
+  Y = s.Y;
+  sp = s.sp;
+  SetStatus(s.status);
+  pc = s.pc;
+  irqPending = s.irqLines;
+}
+
+void mos6502::CopyConfig(const mos6502 &other) {
+  for (int i = 0; i < 32; i++) {
+    irqVectorH[i] = other.irqVectorH[i];
+    irqVectorL[i] = other.irqVectorL[i];
+  }
+  brkVectorH = other.brkVectorH;
+  brkVectorL = other.brkVectorL;
+  rstVectorH = other.rstVectorH;
+  rstVectorL = other.rstVectorL;
+  nmiVectorH = other.nmiVectorH;
+  nmiVectorL = other.nmiVectorL;
+  scramble = other.scramble;
+}
+
+void mos6502::SetBus(BusRead r, BusWrite w) {
+  Read = r;
+  Write = w;
+}
 } // namespace mos6502
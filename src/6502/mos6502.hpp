@@ -10,6 +10,7 @@
 
 #include <iostream>
 #include <stdint.h>
+#include <vector>
 using namespace std;
 namespace mos6502 {
 
@@ -26,8 +27,12 @@ private:
   // program counter
   uint16_t pc;
 
-  // status register
+  // status register, with N, Z, C and V kept separately (see mos6502.cpp)
   uint8_t status;
+  uint16_t nz = 1;
+  bool carry = false, overflow = false;
+  uint8_t GetStatus();
+  void SetStatus(uint8_t s);
 
   // consumed clock cycles
   uint32_t cycles;
@@ -41,11 +46,34 @@ private:
   };
 
   Instr InstrTable[256];
+  // operand bytes following each opcode
+  uint8_t InstrOperands[256];
 
   void Exec(Instr i);
+  uint8_t DecodeOpcode(uint8_t opcode);
+
+  // predecoded instruction cache, see EnableDecodeCache
+  struct DecodedInstr {
+    uint32_t gen;
+    uint8_t opcode;
+    uint8_t operand[2];
+  };
+  std::vector<DecodedInstr> decodeCache;
+  const uint32_t *codeGen = nullptr;
+  uint16_t cacheFirst = 0;
+  bool cacheCheck = false;
+  // operands of the cached instruction being executed, or nullptr
+  const uint8_t *operandPtr = nullptr;
+  inline uint8_t FetchOperand();
+  const DecodedInstr *Decode();
 
   bool illegalOpcode;
 
+  // level-sensitive IRQ lines, one bit per line, and their vectors
+  uint32_t irqPending = 0;
+  uint16_t irqVectorH[32], irqVectorL[32];
+  void ServiceIRQ();
+
   // addressing modes
   uint16_t Addr_ACC(); // ACCUMULATOR
   uint16_t Addr_IMM(); // IMMEDIATE
@@ -149,6 +177,10 @@ public:
   mos6502(BusRead r, BusWrite w);
   void NMI();
   void IRQ(uint16_t vectorH, uint16_t vectorL);
+  // Asserted IRQ lines are serviced at instruction boundaries while the I flag
+  // is clear, lowest line first
+  void SetIRQVector(int line, uint16_t vectorH, uint16_t vectorL);
+  void SetIRQLine(int line, bool asserted);
   void Reset();
   void Run(uint32_t n);
 
@@ -162,6 +194,26 @@ public:
 
   uint16_t GetPC();
 
+  // Architectural state, including the asserted IRQ lines
+  struct State {
+    uint8_t A, X, Y, sp, status;
+    uint16_t pc;
+    uint32_t irqLines;
+  };
+  State GetState();
+  void SetState(const State &s);
+  // Copy IRQ vectors and other configuration from another core
+  void CopyConfig(const mos6502 &other);
+  void SetBus(BusRead r, BusWrite w);
+
+  // Cache decoded instructions fetched from cacheFirst .. 0xFFFF, where reads
+  // must have no side effects. Entries are reused until *gen changes, which the
+  // bus must ensure whenever code in that range may change. If check is set,
+  // each cached instruction is compared against the bus before it runs
+  void EnableDecodeCache(const uint32_t *gen, uint16_t first, bool check);
+  void DisableDecodeCache();
+  uint64_t cacheHits = 0, cacheMisses = 0;
+
   // MiWi2 style scrambling
   bool scramble = false;
 };
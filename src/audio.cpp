@@ -0,0 +1,98 @@
+#include "audio.hpp"
+#include "SDL2/SDL.h"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
+namespace VTxx {
+
+// Ring of packed stereo frames, left in the low half. The producer only writes
+// head and the consumer only writes tail
+static const size_t ring_size = 16384; // must be a power of two
+static uint32_t ring[ring_size];
+static atomic<size_t> ring_head(0), ring_tail(0);
+
+static SDL_AudioDeviceID audio_dev = 0;
+static int audio_rate = 48000;
+static atomic<uint64_t> frames_pushed(0), frames_dropped(0), underruns(0);
+
+static void audio_callback(void *userdata, Uint8 *stream, int len) {
+  int16_t *out = reinterpret_cast<int16_t *>(stream);
+  int frames = len / 4;
+  size_t tail = ring_tail.load(memory_order_relaxed);
+  size_t head = ring_head.load(memory_order_acquire);
+  int avail = int(min<size_t>(head - tail, frames));
+  for (int i = 0; i < avail; i++) {
+    uint32_t f = ring[(tail + i) & (ring_size - 1)];
+    out[2 * i] = int16_t(f & 0xFFFF);
+    out[2 * i + 1] = int16_t(f >> 16);
+  }
+  ring_tail.store(tail + avail, memory_order_release);
+  if (avail < frames) {
+    fill(out + 2 * avail, out + 2 * frames, 0);
+    underruns++;
+  }
+}
+
+bool audio_open(int rate, int buffer_frames) {
+  if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+    cerr << "Failed to init audio: " << SDL_GetError() << endl;
+    return false;
+  }
+  SDL_AudioSpec want, have;
+  SDL_zero(want);
+  want.freq = rate;
+  want.format = AUDIO_S16SYS;
+  want.channels = 2;
+  want.samples = buffer_frames;
+  want.callback = audio_callback;
+  audio_dev = SDL_OpenAudioDevice(nullptr, 0, &want, &have,
+                                  SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (audio_dev == 0) {
+    cerr << "Failed to open audio: " << SDL_GetError() << endl;
+    return false;
+  }
+  audio_rate = have.freq;
+  SDL_PauseAudioDevice(audio_dev, 0);
+  return true;
+}
+
+void audio_close() {
+  if (audio_dev != 0)
+    SDL_CloseAudioDevice(audio_dev);
+  audio_dev = 0;
+}
+
+bool audio_is_open() { return audio_dev != 0; }
+
+int audio_get_rate() { return audio_rate; }
+
+void audio_push(const int16_t *samples, int frames) {
+  frames_pushed += frames;
+  if (audio_dev == 0)
+    return;
+  size_t head = ring_head.load(memory_order_relaxed);
+  size_t tail = ring_tail.load(memory_order_acquire);
+  int space = int(ring_size - (head - tail));
+  if (frames > space) {
+    frames_dropped += (frames - space);
+    frames = space;
+  }
+  for (int i = 0; i < frames; i++)
+    ring[(head + i) & (ring_size - 1)] =
+        uint16_t(samples[2 * i]) |
+        (uint32_t(uint16_t(samples[2 * i + 1])) << 16);
+  ring_head.store(head + frames, memory_order_release);
+}
+
+size_t audio_queued() { return ring_head - ring_tail; }
+
+AudioStats audio_get_stats() {
+  AudioStats st;
+  st.frames_pushed = frames_pushed;
+  st.frames_dropped = frames_dropped;
+  st.underruns = underruns;
+  return st;
+}
+
+} // namespace VTxx
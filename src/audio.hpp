@@ -0,0 +1,33 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+
+namespace VTxx {
+// Audio output. Samples are handed from the emulation thread to the SDL audio
+// callback through a lock-free single producer, single consumer ring. Until a
+// device is opened this is a null sink and samples are discarded
+
+// Open the default output device, returns false on failure
+bool audio_open(int rate, int buffer_frames = 1024);
+void audio_close();
+bool audio_is_open();
+// Rate to produce samples at, the device rate if open
+int audio_get_rate();
+
+// Queue interleaved 16-bit stereo samples. If the ring is full the excess is
+// dropped, which happens when running faster than real time
+void audio_push(const int16_t *samples, int frames);
+// Stereo frames queued but not yet played
+size_t audio_queued();
+
+struct AudioStats {
+  uint64_t frames_pushed = 0;
+  uint64_t frames_dropped = 0; // ring full
+  uint64_t underruns = 0;      // callbacks that ran out of samples
+};
+AudioStats audio_get_stats();
+} // namespace VTxx
+
+#endif /* end of include guard: AUDIO_H */
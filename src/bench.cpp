@@ -0,0 +1,237 @@
+#include "bench.hpp"
+#include "capture.hpp"
+#include "debug.hpp"
+#include "framewriter.hpp"
+#include "lockstep.hpp"
+#include "ppu.hpp"
+#include "profiler.hpp"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace VTxx {
+
+static long get_peak_rss_kb() {
+#ifndef _WIN32
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    return ru.ru_maxrss;
+#endif
+  return 0;
+}
+
+static string render_policy_name(RenderPolicy policy, int n) {
+  switch (policy) {
+  case RenderPolicy::FULL:
+    return "full";
+  case RenderPolicy::EVERY_N:
+    return "every:" + to_string(n);
+  case RenderPolicy::ON_DEMAND:
+    return "demand";
+  default:
+    return "off";
+  }
+}
+
+static string json_escape(const string &s) {
+  ostringstream o;
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      o << '\\' << c;
+    else if (c >= 0 && c < 0x20)
+      o << ' ';
+    else
+      o << c;
+  }
+  return o.str();
+}
+
+// Stop the threads started during setup, for errors after vt168_init
+static int setup_failed() {
+  debug_close();
+  vt168_stop();
+  ppu_stop();
+  capture_close();
+  return 1;
+}
+
+// A frame is finished during the vblank that follows it, so wait for the
+// render thread to publish it. Every rendered frame is taken, even those not
+// dumped, so that the fresh buffer is never a stale one. Frames unchanged
+// since the last one dumped aren't encoded again
+static void dump_frame(FrameWriter *writer, int frame, int every,
+                       uint32_t &last_version) {
+  // The first vblank comes before anything has been rendered
+  if (frame < 2 || !ppu_frame_rendered())
+    return;
+  while (!ppu_acquire_frame())
+    this_thread::yield();
+  if (frame % every != 0)
+    return;
+  uint32_t version = ppu_get_frame_version();
+  writer->write_frame(get_render_buffer(), frame, version == last_version);
+  last_version = version;
+}
+
+bool bench_check_config(const BenchConfig &cfg) {
+  // A capture header records the full frame rate
+  if (!cfg.capture_file.empty() && cfg.render_policy != RenderPolicy::FULL) {
+    cerr << "--capture needs every frame rendered" << endl;
+    return false;
+  }
+  // Only frames that are rendered can be dumped, and nothing requests them on
+  // demand in a batch run
+  FrameFormat fmt;
+  bool every_n = cfg.render_policy == RenderPolicy::EVERY_N;
+  if (!cfg.dump_file.empty()) {
+    if (!frame_format_from_name(cfg.dump_file, fmt)) {
+      cerr << "Unknown dump format: " << cfg.dump_file << endl;
+      return false;
+    }
+    if ((cfg.render_policy != RenderPolicy::FULL && !every_n) ||
+        cfg.dump_every < 1 || (every_n && cfg.dump_every != 1)) {
+      cerr << "--dump needs --render full, or every:N without --dump-every, "
+              "and --dump-every of at least 1"
+           << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+int run_benchmark(VT168_Platform plat, const string &rom,
+                  const BenchConfig &cfg) {
+  // Check options before the emulator threads are started
+  if (!bench_check_config(cfg))
+    return 2;
+  vt168_set_audio_output(1.0f, cfg.resampler);
+  vt168_init(plat, rom, cfg.region);
+  ppu_set_render_policy(cfg.render_policy, cfg.render_every);
+  ppu_set_render_threads(cfg.render_threads);
+  ppu_set_line_reuse(cfg.line_reuse);
+  vt168_set_scpu_thread(cfg.scpu_thread);
+  vt168_set_cpu_cache(cfg.cpu_cache, cfg.cpu_cache_check);
+  if (cfg.lockstep)
+    vt168_start_lockstep();
+  if (!cfg.debug_socket.empty() && !vt168_start_debugger(cfg.debug_socket))
+    return setup_failed();
+  if (!cfg.capture_file.empty() && !vt168_start_capture(cfg.capture_file))
+    return setup_failed();
+  unique_ptr<FrameWriter> dump;
+  if (!cfg.dump_file.empty()) {
+    FrameFormat fmt;
+    frame_format_from_name(cfg.dump_file, fmt);
+    int step = (cfg.render_policy == RenderPolicy::EVERY_N) ? cfg.render_every
+                                                            : cfg.dump_every;
+    dump.reset(new FrameWriter());
+    if (!dump->open_sequence(cfg.dump_file, fmt, 256, 240,
+                             vt168_get_frame_rate() / step))
+      return setup_failed();
+  }
+  vt168_set_fps_report(false);
+  vt168_set_timing(true);
+  if (!cfg.profile.empty())
+    prof_start(plat == VT168_Platform::VT168_MIWI2);
+
+  auto start = chrono::steady_clock::now();
+  int frames = 0;
+  uint32_t dump_version = 0;
+  while (frames < cfg.frames) {
+    if (vt168_tick()) {
+      frames++;
+      if (dump)
+        dump_frame(dump.get(), frames, cfg.dump_every, dump_version);
+    }
+  }
+  double wall_ns = chrono::duration_cast<chrono::nanoseconds>(
+                       chrono::steady_clock::now() - start)
+                       .count();
+  debug_close();
+  uint64_t frames_dumped = 0;
+  if (dump) {
+    dump->close_sequence();
+    frames_dumped = dump->get_frames_written();
+  }
+  vt168_stop();
+  ppu_stop();
+  capture_close();
+  if (!cfg.profile.empty())
+    prof_stop(cfg.profile);
+
+  VT168_Timing t = vt168_get_timing();
+  double render_ns = ppu_get_render_ns();
+  PPUStats ppu_stats = ppu_get_stats();
+  // Sampled times are only estimates, so scale them to split the measured
+  // emulation thread time between subsystems
+  double sampled_ns = t.scpu_ns + t.cpu_ns + t.ppu_ns;
+  double scale = (sampled_ns > 0) ? (wall_ns / sampled_ns) : 0;
+  double mix_linear_ns = mixer_benchmark(ResampleMode::LINEAR);
+  double mix_sinc_ns = mixer_benchmark(ResampleMode::SINC);
+
+  ostringstream js;
+  js << "{" << endl;
+  js << "  \"rom\": \"" << json_escape(rom) << "\"," << endl;
+  js << "  \"platform\": \""
+     << (plat == VT168_Platform::VT168_MIWI2 ? "miwi2" : "vt168") << "\","
+     << endl;
+  js << "  \"frames\": " << frames << "," << endl;
+  js << "  \"render\": "
+     << (cfg.render_policy != RenderPolicy::OFF ? "true" : "false") << ","
+     << endl;
+  js << "  \"render_policy\": \""
+     << render_policy_name(cfg.render_policy, cfg.render_every) << "\","
+     << endl;
+  js << "  \"frames_rendered\": " << ppu_stats.frames_rendered << "," << endl;
+  js << "  \"render_threads\": " << cfg.render_threads << "," << endl;
+  js << "  \"lines_reused\": " << ppu_stats.lines_reused << "," << endl;
+  js << "  \"cpu_cache\": \""
+     << (cfg.cpu_cache ? (cfg.cpu_cache_check ? "check" : "on") : "off")
+     << "\"," << endl;
+  if (dump)
+    js << "  \"frames_dumped\": " << frames_dumped << "," << endl;
+  if (cfg.lockstep)
+    js << "  \"lockstep_instrs\": " << lockstep_get_count() << "," << endl;
+  js << "  \"scpu_thread\": " << (cfg.scpu_thread ? "true" : "false") << ","
+     << endl;
+  js << "  \"wall_s\": " << (wall_ns / 1e9) << "," << endl;
+  js << "  \"emulated_fps\": " << (frames / (wall_ns / 1e9)) << "," << endl;
+  js << "  \"cpu_cycles\": " << t.cpu_clocks << "," << endl;
+  js << "  \"host_ns_per_cpu_cycle\": "
+     << (t.cpu_clocks ? (wall_ns / t.cpu_clocks) : 0) << "," << endl;
+  // The render thread runs in parallel so is not part of the split
+  js << "  \"subsystem_ns\": {" << endl;
+  js << "    \"scpu\": " << uint64_t(t.scpu_ns * scale) << "," << endl;
+  js << "    \"cpu\": " << uint64_t(t.cpu_ns * scale) << "," << endl;
+  js << "    \"ppu_tick\": " << uint64_t(t.ppu_ns * scale) << "," << endl;
+  js << "    \"render_thread\": " << uint64_t(render_ns) << endl;
+  js << "  }," << endl;
+  js << "  \"resampler\": \""
+     << (cfg.resampler == ResampleMode::SINC ? "sinc" : "linear") << "\","
+     << endl;
+  // Cost of mixing and resampling alone, per output sample
+  js << "  \"mixer_ns_per_sample\": {" << endl;
+  js << "    \"linear\": " << mix_linear_ns << "," << endl;
+  js << "    \"sinc\": " << mix_sinc_ns << endl;
+  js << "  }," << endl;
+  js << "  \"peak_rss_kb\": " << get_peak_rss_kb() << endl;
+  js << "}" << endl;
+
+  if (cfg.json_file.empty()) {
+    cout << js.str();
+  } else {
+    ofstream out(cfg.json_file);
+    if (!out) {
+      cerr << "Failed to open " << cfg.json_file << endl;
+      return 1;
+    }
+    out << js.str();
+  }
+  return 0;
+}
+
+} // namespace VTxx
@@ -0,0 +1,51 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include "ppu.hpp"
+#include "vt168.hpp"
+#include <string>
+using namespace std;
+
+namespace VTxx {
+struct BenchConfig {
+  int frames = 600;
+  // n is used by RenderPolicy::EVERY_N
+  RenderPolicy render_policy = RenderPolicy::FULL;
+  int render_every = 1;
+  // Render in bands on this many threads if more than one
+  int render_threads = 1;
+  // Copy unchanged lines from the last frame rather than rendering them
+  bool line_reuse = true;
+  // Run the SCPU on its own thread
+  bool scpu_thread = false;
+  // Run main CPU code from the decode cache, optionally checking each entry
+  bool cpu_cache = false, cpu_cache_check = false;
+  // Validate the main CPU against a reference core in lockstep
+  bool lockstep = false;
+  // If set, serve the debugger on this socket path
+  string debug_socket;
+  // If set, record video and audio to this file
+  string capture_file;
+  // Batch runs default to the cheap resampler
+  ResampleMode resampler = ResampleMode::LINEAR;
+  VT168_Region region = VT168_Region::PAL;
+  // Results are written as JSON to this file, or stdout if empty
+  string json_file;
+  // If set, profile guest code and write the results using this basename
+  string profile;
+  // If set, write every dump_every'th frame here, in the format given by the
+  // extension (see FrameFormat)
+  string dump_file;
+  int dump_every = 1;
+};
+
+// Check for options that can't be used together, printing why. Call before
+// vt168_init
+bool bench_check_config(const BenchConfig &cfg);
+
+// Run a ROM headless and unthrottled for a fixed number of frames, then report
+// throughput. Returns the process exit code
+int run_benchmark(VT168_Platform plat, const string &rom,
+                  const BenchConfig &cfg);
+} // namespace VTxx
+
+#endif /* end of include guard: BENCH_H */
@@ -0,0 +1,280 @@
+#include "capture.hpp"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace VTxx {
+
+atomic<bool> capture_armed(false);
+
+// Frames and audio blocks share one pool of slots, queued in the order they
+// were pushed. A frame is about 240KB, so this holds a quarter of a second
+static const int slot_count = 16;
+
+struct CaptureSlot {
+  bool is_frame = false;
+  vector<uint32_t> pixels;
+  vector<int16_t> samples;
+};
+
+static vector<CaptureSlot> slots;
+static deque<int> free_slots, full_slots;
+static mutex slot_mutex;
+static condition_variable free_cv, full_cv;
+static thread writer;
+static bool writer_quit = false;
+static FILE *capture_file = nullptr;
+static int cap_width = 0, cap_height = 0;
+
+// Writer thread state
+static vector<uint32_t> prev_frame, delta;
+static vector<uint8_t> packed;
+static vector<pair<uint32_t, uint64_t>> key_index;
+static uint64_t file_pos = 0;
+static uint32_t frames_written = 0;
+static uint64_t audio_written = 0;
+static bool write_failed = false;
+
+static void put_le(vector<uint8_t> &out, uint64_t x, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    out.push_back((x >> (8 * i)) & 0xFF);
+}
+
+static void write_bytes(const void *data, size_t len) {
+  if (fwrite(data, 1, len, capture_file) != len && !write_failed) {
+    cerr << "Failed to write capture" << endl;
+    write_failed = true;
+  }
+  file_pos += len;
+}
+
+static void write_chunk(const char *tag, const vector<uint8_t> &payload) {
+  vector<uint8_t> hdr(tag, tag + 4);
+  put_le(hdr, payload.size(), 4);
+  write_bytes(hdr.data(), hdr.size());
+  write_bytes(payload.data(), payload.size());
+}
+
+// LZ4 block format, greedy matching on a hash of 4 byte sequences. XORed
+// frames are mostly runs of zeros, which this handles well
+static const int lz4_hash_bits = 12;
+static const size_t lz4_min_match = 4, lz4_last_literals = 5,
+                    lz4_match_limit = 12;
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t x;
+  memcpy(&x, p, 4);
+  return x;
+}
+
+static void lz4_length(vector<uint8_t> &out, size_t len) {
+  while (len >= 255) {
+    out.push_back(255);
+    len -= 255;
+  }
+  out.push_back(uint8_t(len));
+}
+
+static void lz4_sequence(vector<uint8_t> &out, const uint8_t *lit,
+                         size_t lit_len, size_t offset, size_t match_len) {
+  size_t ml = (match_len > 0) ? (match_len - lz4_min_match) : 0;
+  out.push_back(
+      uint8_t((min<size_t>(lit_len, 15) << 4) | min<size_t>(ml, 15)));
+  if (lit_len >= 15)
+    lz4_length(out, lit_len - 15);
+  out.insert(out.end(), lit, lit + lit_len);
+  if (match_len == 0)
+    return;
+  out.push_back(offset & 0xFF);
+  out.push_back(offset >> 8);
+  if (ml >= 15)
+    lz4_length(out, ml - 15);
+}
+
+static void lz4_compress(const uint8_t *src, size_t len,
+                         vector<uint8_t> &out) {
+  static uint32_t table[1 << lz4_hash_bits];
+  // Positions are stored plus one, so zero is empty
+  fill(table, table + (1 << lz4_hash_bits), 0);
+  size_t anchor = 0, ip = 0;
+  int misses = 0;
+  while (ip + lz4_match_limit <= len) {
+    uint32_t seq = read32(src + ip);
+    uint32_t h = (seq * 2654435761U) >> (32 - lz4_hash_bits);
+    size_t ref = table[h];
+    table[h] = uint32_t(ip + 1);
+    if (ref == 0 || ip - (ref - 1) > 65535 || read32(src + ref - 1) != seq) {
+      // Skip faster through data that doesn't compress
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    ref--;
+    size_t match_len = lz4_min_match;
+    while (ip + match_len < len - lz4_last_literals &&
+           src[ref + match_len] == src[ip + match_len])
+      match_len++;
+    lz4_sequence(out, src + anchor, ip - anchor, ip - ref, match_len);
+    ip += match_len;
+    anchor = ip;
+    misses = 0;
+  }
+  lz4_sequence(out, src + anchor, len - anchor, 0, 0);
+}
+
+static void write_frame(const vector<uint32_t> &pixels) {
+  bool key = (frames_written % capture_key_interval) == 0;
+  if (key) {
+    delta = pixels;
+    key_index.push_back(make_pair(frames_written, file_pos));
+  } else {
+    for (size_t i = 0; i < pixels.size(); i++)
+      delta[i] = pixels[i] ^ prev_frame[i];
+  }
+  prev_frame = pixels;
+  packed.clear();
+  put_le(packed, frames_written, 4);
+  lz4_compress(reinterpret_cast<const uint8_t *>(delta.data()),
+               delta.size() * 4, packed);
+  write_chunk(key ? "VKEY" : "VDLT", packed);
+  frames_written++;
+}
+
+static void write_audio(const vector<int16_t> &samples) {
+  packed.clear();
+  for (int16_t s : samples)
+    put_le(packed, uint16_t(s), 2);
+  write_chunk("AUDI", packed);
+  audio_written += samples.size() / 2;
+}
+
+static void writer_fn() {
+  while (true) {
+    int idx;
+    {
+      unique_lock<mutex> lk(slot_mutex);
+      full_cv.wait(lk, [] { return !full_slots.empty() || writer_quit; });
+      if (full_slots.empty())
+        return;
+      idx = full_slots.front();
+      full_slots.pop_front();
+    }
+    CaptureSlot &s = slots[idx];
+    if (s.is_frame)
+      write_frame(s.pixels);
+    else
+      write_audio(s.samples);
+    {
+      lock_guard<mutex> lk(slot_mutex);
+      free_slots.push_back(idx);
+    }
+    free_cv.notify_one();
+  }
+}
+
+static int take_slot() {
+  unique_lock<mutex> lk(slot_mutex);
+  free_cv.wait(lk, [] { return !free_slots.empty(); });
+  int idx = free_slots.front();
+  free_slots.pop_front();
+  return idx;
+}
+
+static void submit_slot(int idx) {
+  {
+    lock_guard<mutex> lk(slot_mutex);
+    full_slots.push_back(idx);
+  }
+  full_cv.notify_one();
+}
+
+bool capture_open(const string &file, int width, int height, double fps,
+                  int audio_rate) {
+  capture_file = fopen(file.c_str(), "wb");
+  if (capture_file == nullptr) {
+    cerr << "Failed to open capture file " << file << endl;
+    return false;
+  }
+  cap_width = width;
+  cap_height = height;
+  slots.resize(slot_count);
+  free_slots.clear();
+  full_slots.clear();
+  for (int i = 0; i < slot_count; i++) {
+    slots[i].pixels.resize(width * height);
+    free_slots.push_back(i);
+  }
+  delta.resize(width * height);
+  key_index.clear();
+  file_pos = 0;
+  frames_written = 0;
+  audio_written = 0;
+  write_failed = false;
+
+  vector<uint8_t> hdr(capture_magic, capture_magic + 8);
+  put_le(hdr, width, 2);
+  put_le(hdr, height, 2);
+  put_le(hdr, uint32_t(lround(fps * 1000)), 4);
+  put_le(hdr, audio_rate, 4);
+  put_le(hdr, capture_key_interval, 4);
+  write_bytes(hdr.data(), hdr.size());
+
+  writer_quit = false;
+  writer = thread(writer_fn);
+  capture_armed = true;
+  return true;
+}
+
+void capture_close() {
+  if (capture_file == nullptr)
+    return;
+  capture_armed = false;
+  {
+    lock_guard<mutex> lk(slot_mutex);
+    writer_quit = true;
+  }
+  full_cv.notify_one();
+  writer.join();
+
+  uint64_t index_pos = file_pos;
+  packed.clear();
+  for (const auto &e : key_index) {
+    put_le(packed, e.first, 4);
+    put_le(packed, e.second, 8);
+  }
+  write_chunk("INDX", packed);
+  packed.clear();
+  put_le(packed, index_pos, 8);
+  packed.insert(packed.end(), capture_index_magic, capture_index_magic + 8);
+  write_bytes(packed.data(), packed.size());
+  fclose(capture_file);
+  capture_file = nullptr;
+  cout << "Captured " << frames_written << " frames, " << audio_written
+       << " audio samples, " << file_pos << " bytes" << endl;
+}
+
+void capture_push_frame(const uint32_t *argb) {
+  int idx = take_slot();
+  CaptureSlot &s = slots[idx];
+  s.is_frame = true;
+  copy(argb, argb + cap_width * cap_height, s.pixels.begin());
+  submit_slot(idx);
+}
+
+void capture_push_audio(const int16_t *samples, int frames) {
+  if (frames == 0)
+    return;
+  int idx = take_slot();
+  CaptureSlot &s = slots[idx];
+  s.is_frame = false;
+  s.samples.assign(samples, samples + 2 * frames);
+  submit_slot(idx);
+}
+
+} // namespace VTxx
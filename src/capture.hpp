@@ -0,0 +1,57 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <atomic>
+#include <cstdint>
+#include <string>
+using namespace std;
+
+namespace VTxx {
+// Lossless recording of the PPU output and the sound output. Frames and audio
+// are copied into a fixed pool of buffers, and compressed and written to disk
+// by a background thread; the copy waits for a free buffer if all are queued,
+// so the capture is never lossy. Convert with tools/vtcap.
+//
+// All values are little endian. The file starts with capture_magic and:
+//   width, height    16 bits each
+//   frame rate       32 bits, in millihertz
+//   audio rate       32 bits, samples per second (audio is 16-bit stereo)
+//   key interval     32 bits, frames between key frames
+// followed by chunks of a 4 byte tag, a 32-bit payload length and the payload:
+//   VKEY, VDLT  32-bit frame number then an LZ4 block holding the frame as
+//               32-bit ARGB pixels, XORed with the previous frame for VDLT
+//   AUDI        interleaved 16-bit stereo samples
+//   INDX        the last chunk: 32-bit frame number and 64-bit file offset of
+//               every VKEY chunk
+// The file ends with the 64-bit offset of the INDX chunk and
+// capture_index_magic. A capture that wasn't closed lacks the index, but all
+// complete chunks can still be read in order
+static const char capture_magic[8] = {'V', 'T', 'C', 'A', 'P', 'T', 'R', '1'};
+static const char capture_index_magic[8] = {'V', 'T', 'C', 'A',
+                                            'P', 'I', 'D', 'X'};
+static const uint32_t capture_key_interval = 60;
+
+// Start capturing to file. Call after init, while the emulator is not running
+bool capture_open(const string &file, int width, int height, double fps,
+                  int audio_rate);
+// Write everything queued and the index. Call after the emulator and the
+// render thread have stopped
+void capture_close();
+
+// True while a capture file is open
+extern atomic<bool> capture_armed;
+void capture_push_frame(const uint32_t *argb);
+void capture_push_audio(const int16_t *samples, int frames);
+
+// Call with each completed frame
+inline void capture_frame(const uint32_t *argb) {
+  if (capture_armed.load(memory_order_relaxed))
+    capture_push_frame(argb);
+}
+// Call with each block of sound output
+inline void capture_audio(const int16_t *samples, int frames) {
+  if (capture_armed.load(memory_order_relaxed))
+    capture_push_audio(samples, frames);
+}
+} // namespace VTxx
+
+#endif /* end of include guard: CAPTURE_H */
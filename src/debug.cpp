@@ -0,0 +1,431 @@
+#include "debug.hpp"
+#include "6502/mos6502.hpp"
+#include "mmu.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace VTxx {
+
+atomic<bool> debug_armed(false);
+
+struct Watch {
+  uint32_t addr, len;
+  bool physical, read, write;
+};
+
+static mos6502::mos6502 *cpu = nullptr;
+
+// The debugger state below is changed by the server thread only while the CPU
+// is paused (holding state_mutex), and otherwise only by the emulator thread
+static vector<bool> breakpoints(0x10000, false);
+static int break_count[256] = {0}; // per 256 byte page of PC
+static int32_t temp_break = -1;
+static uint64_t steps_left = 0, frames_left = 0;
+static vector<Watch> watches;
+// Reason for a stop requested mid-instruction, taken at the next instruction
+static string stop_reason;
+static atomic<bool> pause_req(false);
+
+static mutex state_mutex;
+static condition_variable resume_cv, stopped_cv;
+static bool paused = false;
+static atomic<bool> closing(false);
+
+static thread server;
+static mutex send_mutex;
+static int listen_fd = -1, client_fd = -1;
+static string socket_path;
+
+static string hex_str(uint32_t x, int digits) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%0*X", digits, x);
+  return buf;
+}
+
+static void send_line(const string &line) {
+#ifndef _WIN32
+  lock_guard<mutex> lk(send_mutex);
+  if (client_fd < 0)
+    return;
+  string s = line + "\n";
+  send(client_fd, s.data(), s.size(), MSG_NOSIGNAL);
+#endif
+}
+
+static void update_armed() {
+  bool any_break = false;
+  for (int i = 0; i < 256 && !any_break; i++)
+    any_break = break_count[i] > 0;
+  debug_armed = any_break || temp_break >= 0 || steps_left > 0 ||
+                frames_left > 0 || !stop_reason.empty() || pause_req;
+}
+
+static void stop(const string &reason, uint16_t pc) {
+  unique_lock<mutex> lk(state_mutex);
+  if (closing)
+    return;
+  steps_left = frames_left = 0;
+  temp_break = -1;
+  pause_req = false;
+  paused = true;
+  send_line("stopped " + reason + " pc=" + hex_str(pc, 4));
+  stopped_cv.notify_all();
+  resume_cv.wait(lk, [] { return !paused; });
+}
+
+void debug_check(uint16_t pc) {
+  string reason;
+  if (!stop_reason.empty()) {
+    reason = stop_reason;
+    stop_reason.clear();
+  } else if (pause_req) {
+    reason = "pause";
+  } else if (steps_left > 0 && --steps_left == 0) {
+    reason = "step";
+  } else if (int32_t(pc) == temp_break) {
+    reason = "next";
+  } else if (break_count[pc >> 8] > 0 && breakpoints[pc]) {
+    reason = "break";
+  }
+  if (!reason.empty())
+    stop(reason, pc);
+}
+
+void debug_frame_event() {
+  if (frames_left > 0 && --frames_left == 0 && stop_reason.empty())
+    stop_reason = "frame";
+}
+
+static void watch_hit(uint32_t addr, bool physical, bool write, uint8_t data) {
+  if (closing || !stop_reason.empty())
+    return;
+  for (const auto &w : watches) {
+    if (w.physical != physical || addr < w.addr || addr >= w.addr + w.len ||
+        !(write ? w.write : w.read))
+      continue;
+    stop_reason = string("watch ") + (write ? "w " : "r ") +
+                  (physical ? "p" : "") + hex_str(addr, physical ? 6 : 4);
+    if (write)
+      stop_reason += "=" + hex_str(data, 2);
+    debug_armed = true;
+    return;
+  }
+}
+
+static void apply_watches() {
+  WatchPages pages;
+  for (const auto &w : watches) {
+    for (uint32_t a = w.addr; a < w.addr + w.len; a++) {
+      if (w.physical) {
+        if (a == w.addr || (a & 0x1FFF) == 0)
+          pages.physical.push_back(a >> 13);
+      } else if (a < 0x2000) {
+        pages.ram[a >> 8] = true;
+      } else if (a < 0x2200) {
+        pages.reg_write[a - 0x2000] = true;
+      } else {
+        pages.rom[a >> 13] = true;
+      }
+    }
+  }
+  mmu_set_watch(watches.empty() ? nullptr : watch_hit, pages);
+}
+
+static void resume() {
+  paused = false;
+  update_armed();
+  resume_cv.notify_all();
+}
+
+static string add_watch(istringstream &args, bool physical) {
+  string mode;
+  Watch w;
+  w.len = 1;
+  if (!(args >> mode >> hex >> w.addr))
+    return "error usage: watch r|w|rw ADDR [LEN]";
+  args >> hex >> w.len;
+  w.physical = physical;
+  w.read = (mode == "r" || mode == "rw");
+  w.write = (mode == "w" || mode == "rw");
+  if (!w.read && !w.write)
+    return "error mode must be r, w or rw";
+  if (w.len == 0)
+    return "error zero length";
+  uint32_t last = w.addr + w.len - 1;
+  if (!physical) {
+    if (last > 0xFFFF)
+      return "error past end of address space";
+    if ((w.addr < 0x2000) != (last < 0x2000) ||
+        (w.addr < 0x4000) != (last < 0x4000))
+      return "error range crosses RAM, register and ROM space";
+    if (w.addr >= 0x2000 && w.addr < 0x4000) {
+      if (last >= 0x2200)
+        return "error nothing to watch at 2200 .. 3FFF";
+      if (w.read)
+        return "error register watches are write only";
+    }
+  }
+  watches.push_back(w);
+  apply_watches();
+  return "ok";
+}
+
+static string list() {
+  string s = "ok";
+  for (uint32_t a = 0; a < 0x10000; a++)
+    if (breakpoints[a])
+      s += " break " + hex_str(a, 4);
+  for (const auto &w : watches) {
+    s += w.physical ? " pwatch " : " watch ";
+    s += string(w.read ? "r" : "") + (w.write ? "w " : " ");
+    s += hex_str(w.addr, w.physical ? 6 : 4) + " " + hex_str(w.len, 1);
+  }
+  return s;
+}
+
+static string regs() {
+  auto s = cpu->GetState();
+  return "ok a=" + hex_str(s.A, 2) + " x=" + hex_str(s.X, 2) +
+         " y=" + hex_str(s.Y, 2) + " sp=" + hex_str(s.sp, 2) +
+         " p=" + hex_str(s.status, 2) + " pc=" + hex_str(s.pc, 4);
+}
+
+static string set_reg(istringstream &args) {
+  string reg;
+  uint32_t value;
+  if (!(args >> reg >> hex >> value))
+    return "error usage: set REG VALUE";
+  auto s = cpu->GetState();
+  if (reg == "a")
+    s.A = value;
+  else if (reg == "x")
+    s.X = value;
+  else if (reg == "y")
+    s.Y = value;
+  else if (reg == "sp")
+    s.sp = value;
+  else if (reg == "p")
+    s.status = value;
+  else if (reg == "pc")
+    s.pc = value;
+  else
+    return "error unknown register " + reg;
+  cpu->SetState(s);
+  return "ok";
+}
+
+static string dump(istringstream &args, bool physical) {
+  uint32_t addr, len;
+  if (!(args >> hex >> addr >> len))
+    return "error usage: mem ADDR LEN";
+  if (len > 0x1000)
+    return "error at most 1000 bytes";
+  string s = "ok";
+  for (uint32_t i = 0; i < len; i++) {
+    uint8_t d = physical ? peek_mem_physical(addr + i)
+                         : peek_mem_virtual(uint16_t(addr + i));
+    s += " " + hex_str(d, 2);
+  }
+  return s;
+}
+
+// Called with state_mutex held
+static string command(const string &line) {
+  istringstream args(line);
+  string cmd;
+  if (!(args >> cmd))
+    return "error empty command";
+  if (cmd == "pause") {
+    if (paused)
+      return "error already paused";
+    pause_req = true;
+    debug_armed = true;
+    return "ok";
+  }
+  if (!paused)
+    return "error running, only pause is accepted";
+  uint32_t n = 1;
+  if (cmd == "continue") {
+    resume();
+  } else if (cmd == "step") {
+    args >> dec >> n;
+    steps_left = max(n, 1U);
+    resume();
+  } else if (cmd == "next") {
+    uint16_t pc = cpu->GetPC();
+    // JSR is 0x20 whether or not opcodes are scrambled
+    if (peek_mem_virtual(pc) == 0x20)
+      temp_break = uint16_t(pc + 3);
+    else
+      steps_left = 1;
+    resume();
+  } else if (cmd == "frame") {
+    args >> dec >> n;
+    frames_left = max(n, 1U);
+    resume();
+  } else if (cmd == "break" || cmd == "delete") {
+    uint32_t addr;
+    if (!(args >> hex >> addr) || addr > 0xFFFF)
+      return "error usage: " + cmd + " ADDR";
+    bool set = (cmd == "break");
+    if (breakpoints[addr] == set)
+      return set ? "error breakpoint exists" : "error no breakpoint";
+    breakpoints[addr] = set;
+    break_count[addr >> 8] += set ? 1 : -1;
+  } else if (cmd == "watch" || cmd == "pwatch") {
+    return add_watch(args, cmd == "pwatch");
+  } else if (cmd == "unwatch") {
+    uint32_t addr;
+    if (!(args >> hex >> addr))
+      return "error usage: unwatch ADDR";
+    size_t count = watches.size();
+    for (auto it = watches.begin(); it != watches.end();)
+      it = (it->addr == addr) ? watches.erase(it) : it + 1;
+    if (watches.size() == count)
+      return "error no watch";
+    apply_watches();
+  } else if (cmd == "list") {
+    return list();
+  } else if (cmd == "regs") {
+    return regs();
+  } else if (cmd == "set") {
+    return set_reg(args);
+  } else if (cmd == "mem" || cmd == "pmem") {
+    return dump(args, cmd == "pmem");
+  } else {
+    return "error unknown command " + cmd;
+  }
+  return "ok";
+}
+
+// Remove everything and resume, when the client goes away
+static void detach() {
+  unique_lock<mutex> lk(state_mutex);
+  if (!paused) {
+    pause_req = true;
+    debug_armed = true;
+    stopped_cv.wait(lk, [] { return paused || closing; });
+  }
+  if (closing)
+    return;
+  fill(breakpoints.begin(), breakpoints.end(), false);
+  fill(break_count, break_count + 256, 0);
+  watches.clear();
+  apply_watches();
+  resume();
+}
+
+#ifndef _WIN32
+static void server_fn() {
+  while (true) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0)
+      return;
+    {
+      lock_guard<mutex> lk(send_mutex);
+      client_fd = fd;
+    }
+    {
+      lock_guard<mutex> lk(state_mutex);
+      if (paused)
+        send_line("stopped pause pc=" + hex_str(cpu->GetPC(), 4));
+    }
+    string buf;
+    char tmp[256];
+    ssize_t n;
+    while ((n = recv(fd, tmp, sizeof(tmp), 0)) > 0) {
+      buf.append(tmp, n);
+      size_t eol;
+      while ((eol = buf.find('\n')) != string::npos) {
+        string line = buf.substr(0, eol);
+        buf.erase(0, eol + 1);
+        if (!line.empty() && line.back() == '\r')
+          line.pop_back();
+        lock_guard<mutex> lk(state_mutex);
+        send_line(command(line));
+      }
+    }
+    {
+      lock_guard<mutex> lk(send_mutex);
+      client_fd = -1;
+    }
+    close(fd);
+    detach();
+    if (closing)
+      return;
+  }
+}
+
+bool debug_open(const string &path, mos6502::mos6502 *c) {
+  sockaddr_un sa = {};
+  if (path.size() >= sizeof(sa.sun_path)) {
+    cerr << "Debugger socket path too long" << endl;
+    return false;
+  }
+  sa.sun_family = AF_UNIX;
+  path.copy(sa.sun_path, path.size());
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path.c_str());
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa)) != 0 ||
+      listen(listen_fd, 1) != 0) {
+    cerr << "Failed to open debugger socket " << path << endl;
+    if (listen_fd >= 0)
+      close(listen_fd);
+    listen_fd = -1;
+    return false;
+  }
+  socket_path = path;
+  cpu = c;
+  closing = false;
+  pause_req = true;
+  debug_armed = true;
+  server = thread(server_fn);
+  cout << "Debugger listening on " << path << endl;
+  return true;
+}
+
+void debug_close() {
+  if (listen_fd < 0)
+    return;
+  {
+    lock_guard<mutex> lk(state_mutex);
+    closing = true;
+    debug_armed = false;
+    paused = false;
+    pause_req = false;
+    resume_cv.notify_all();
+    stopped_cv.notify_all();
+  }
+  shutdown(listen_fd, SHUT_RDWR);
+  {
+    lock_guard<mutex> lk(send_mutex);
+    if (client_fd >= 0)
+      shutdown(client_fd, SHUT_RDWR);
+  }
+  server.join();
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(socket_path.c_str());
+}
+#else
+bool debug_open(const string &path, mos6502::mos6502 *c) {
+  cerr << "The debugger is not supported on Windows" << endl;
+  return false;
+}
+
+void debug_close() {}
+#endif
+
+} // namespace VTxx
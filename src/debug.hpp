@@ -0,0 +1,63 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+#include <atomic>
+#include <cstdint>
+#include <string>
+using namespace std;
+
+namespace mos6502 {
+class mos6502;
+};
+
+namespace VTxx {
+// Interactive debugger for the main CPU, served over a Unix domain socket as a
+// line protocol (try "socat - UNIX-CONNECT:path"). Each command gets one reply
+// line, "ok ..." or "error ...". While running, "stopped REASON pc=XXXX" is sent
+// whenever the CPU stops. All addresses and values are hex.
+//
+//   pause                    stop before the next instruction
+//   continue                 resume
+//   step [N]                 run N instructions (default 1)
+//   next                     as step, but run a JSR through to its return
+//   frame [N]                run N frames (default 1)
+//   break ADDR               stop before executing ADDR
+//   delete ADDR              remove a breakpoint
+//   watch r|w|rw ADDR [LEN]  stop after an access to ADDR .. ADDR+LEN-1;
+//                            register (0x2000 .. 0x21FF) watches are write only
+//   pwatch r|w|rw ADDR [LEN] as watch, for physical ROM addresses
+//   unwatch ADDR             remove watches starting at ADDR (either kind)
+//   list                     show breakpoints and watches
+//   regs                     show CPU registers
+//   set a|x|y|sp|p|pc VALUE  set a CPU register
+//   mem ADDR LEN             read CPU memory, without side effects
+//   pmem ADDR LEN            read physical ROM memory
+//
+// Only pause is accepted while running. The CPU is paused when the debugger
+// starts, and disconnecting removes everything and resumes.
+
+// Start listening on path, stopping the CPU before its first instruction.
+// Returns false on failure or if unsupported on this platform
+bool debug_open(const string &path, mos6502::mos6502 *cpu);
+// Stop the server and resume the CPU if paused. Call before joining the thread
+// running the emulator
+void debug_close();
+
+// True while there is anything to check for: breakpoints, stepping, or a
+// pending stop. Watchpoints are handled by the MMU and need no check here
+extern atomic<bool> debug_armed;
+void debug_check(uint16_t pc);
+void debug_frame_event();
+
+// Call before each main CPU instruction
+inline void debug_instr(uint16_t pc) {
+  if (debug_armed.load(memory_order_relaxed))
+    debug_check(pc);
+}
+// Call at the start of each frame
+inline void debug_frame() {
+  if (debug_armed.load(memory_order_relaxed))
+    debug_frame_event();
+}
+} // namespace VTxx
+
+#endif /* end of include guard: DEBUG_H */
@@ -1,10 +1,14 @@
 #include "dma.hpp"
 #include "mmu.hpp"
+#include "ppu.hpp"
 #include "util.hpp"
 #include <cassert>
 #include <iostream>
 namespace VTxx {
 
+// A read and a write on the bus for each byte
+static const int cycles_per_byte = 2;
+
 DMACtrl::DMACtrl() {
   for (int i = 0; i < 7; i++)
     dma_regs[i] = 0;
@@ -22,7 +26,7 @@ void DMACtrl::write(uint8_t addr, uint8_t data) {
     if (is_vram_xfer()) {
       waiting_vblank = true;
     } else {
-      do_xfer();
+      start_xfer();
     }
   }
 }
@@ -37,6 +41,25 @@ uint8_t DMACtrl::read(uint8_t addr) {
   }
 }
 
+int DMACtrl::get_len() {
+  int len = unsigned(dma_regs[5]) * 2;
+  if (len == 0)
+    len = 512;
+  return len;
+}
+
+// The data is moved when the stall ends, so the transfer appears to take the
+// right amount of time to anything not stalled
+void DMACtrl::start_xfer() {
+  stall = get_len() * cycles_per_byte;
+  stall_cycles += stall;
+}
+
+void DMACtrl::tick() {
+  if (stall > 0 && --stall == 0)
+    do_xfer();
+}
+
 void DMACtrl::do_xfer() {
   bool is_extsrc = get_bit(get_src_addr(), 15);
   uint32_t srcaddr_c = get_src_addr() & 0x7FFF;
@@ -55,25 +78,39 @@ void DMACtrl::do_xfer() {
   bool vram_dest = is_vram_xfer();
   if (!vram_dest)
     dstaddr_c &= ~0x01;
-  int len = unsigned(dma_regs[5]) * 2;
-  if (len == 0)
-    len = 512;
+  int len = get_len();
+  // Reading RAM shared with the SCPU must wait for it
+  if (!is_extsrc && shared_ram_hook != nullptr &&
+      ((srcaddr_c & 0x1FFF) + len) > 0x1000)
+    shared_ram_hook();
   /*if (vram_dest)
     cout << "VDMA " << len << " " << get_dst_addr() << endl;*/
-  for (int i = 0; i < len; i++) {
-    uint8_t dat =
-        is_extsrc ? read_mem_physical(srcaddr_c) : cpu_ram[srcaddr_c & 0x1FFF];
+  if (vram_dest) {
+    // Gather the source and write it to the PPU in one go
+    uint8_t buf[512];
+    for (int i = 0; i < len; i++) {
+      buf[i] = is_extsrc ? read_mem_physical(srcaddr_c)
+                         : cpu_ram[srcaddr_c & 0x1FFF];
+      srcaddr_c++;
+    }
+    ppu_dma_write(dstaddr_c & 0xFF, buf, len);
+    mmio_write_count[dstaddr_c - 0x2000] += len;
+  } else {
+    for (int i = 0; i < len; i++) {
+      uint8_t dat = is_extsrc ? read_mem_physical(srcaddr_c)
+                              : cpu_ram[srcaddr_c & 0x1FFF];
 
-    // TODO: accelerate VRAM writes?
-    if (is_extdst)
-      write_mem_physical(dstaddr_c, dat);
-    else
-      write_mem_virtual(dstaddr_c, dat);
+      if (is_extdst)
+        write_mem_physical(dstaddr_c, dat);
+      else
+        write_mem_virtual(dstaddr_c, dat);
 
-    if (!vram_dest)
-      dstaddr_c++;
-    srcaddr_c++;
+      if (!vram_dest)
+        dstaddr_c++;
+      srcaddr_c++;
+    }
   }
+  bytes_moved += len;
   dma_regs[3] = (dma_regs[3] & 0x80) | ((srcaddr_c >> 8) & 0x7F);
   dma_regs[2] = (srcaddr_c & 0xFF);
   if (is_extsrc) {
@@ -86,7 +123,7 @@ void DMACtrl::do_xfer() {
 void DMACtrl::vblank_notify() {
   if (waiting_vblank) {
     waiting_vblank = false;
-    do_xfer();
+    start_xfer();
   }
 }
 
@@ -95,6 +132,7 @@ void DMACtrl::reset() {
     dma_regs[i] = 0;
   }
   waiting_vblank = false;
+  stall = 0;
 }
 
 } // namespace VTxx
@@ -12,15 +12,27 @@ public:
   uint8_t read(uint8_t addr);
 
   void vblank_notify(); // notify the DMA engine of the start of VBLANK
+  // Call once per CPU clock while busy; the CPU is stalled until the transfer
+  // completes
+  void tick();
 
-  inline bool is_busy() { return waiting_vblank; }
+  inline bool is_busy() { return waiting_vblank || (stall > 0); }
 
   void reset();
 
+  // Total bytes transferred, for performance counters
+  uint64_t bytes_moved = 0;
+  // Total CPU clocks stalled by transfers
+  uint64_t stall_cycles = 0;
+
 private:
   bool waiting_vblank = false;
+  // CPU clocks until the current transfer completes
+  int stall = 0;
   uint8_t dma_regs[7] = {0};
+  void start_xfer();
   void do_xfer();
+  int get_len();
   bool is_vram_xfer();
   inline uint16_t get_src_addr() { return (dma_regs[3] << 8UL) | dma_regs[2]; }
   inline uint16_t get_dst_addr() { return (dma_regs[1] << 8UL) | dma_regs[0]; }
@@ -0,0 +1,312 @@
+#include "framewriter.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace VTxx {
+
+bool frame_format_from_name(const string &filename, FrameFormat &fmt) {
+  size_t dot = filename.rfind('.');
+  if (dot == string::npos)
+    return false;
+  string ext = filename.substr(dot + 1);
+  transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  if (ext == "bmp")
+    fmt = FrameFormat::BMP;
+  else if (ext == "png")
+    fmt = FrameFormat::PNG;
+  else if (ext == "y4m")
+    fmt = FrameFormat::Y4M;
+  else if (ext == "rgb")
+    fmt = FrameFormat::RGB;
+  else
+    return false;
+  return true;
+}
+
+static void put_le(vector<uint8_t> &out, uint32_t x, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    out.push_back((x >> (8 * i)) & 0xFF);
+}
+
+static void put_be32(vector<uint8_t> &out, uint32_t x) {
+  for (int i = 3; i >= 0; i--)
+    out.push_back((x >> (8 * i)) & 0xFF);
+}
+
+static void encode_bmp(const uint32_t *argb, int width, int height,
+                       vector<uint8_t> &out) {
+  int rowsize = ((3 * width + 3) / 4) * 4;
+  out.push_back('B');
+  out.push_back('M');
+  put_le(out, 54 + height * rowsize, 4);
+  put_le(out, 0, 4);
+  put_le(out, 54, 4);
+  put_le(out, 40, 4); // BITMAPINFOHEADER
+  put_le(out, width, 4);
+  put_le(out, height, 4);
+  put_le(out, 1, 2);
+  put_le(out, 24, 2);
+  put_le(out, 0, 4);
+  put_le(out, height * rowsize, 4);
+  put_le(out, 3543, 4); // 90 dpi
+  put_le(out, 3543, 4);
+  put_le(out, 0, 4);
+  put_le(out, 0, 4);
+  for (int y = height - 1; y >= 0; y--) {
+    const uint32_t *row = argb + y * width;
+    for (int x = 0; x < width; x++) {
+      out.push_back(row[x] & 0xFF);
+      out.push_back((row[x] >> 8) & 0xFF);
+      out.push_back((row[x] >> 16) & 0xFF);
+    }
+    out.insert(out.end(), rowsize - 3 * width, 0);
+  }
+}
+
+static vector<uint32_t> make_crc_table() {
+  vector<uint32_t> table(256);
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+    table[n] = c;
+  }
+  return table;
+}
+
+static uint32_t crc32(const uint8_t *data, size_t len) {
+  static const vector<uint32_t> crc_table = make_crc_table();
+  uint32_t c = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++)
+    c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+  return c ^ 0xFFFFFFFF;
+}
+
+static void png_chunk(vector<uint8_t> &out, const char *type,
+                      const vector<uint8_t> &data) {
+  put_be32(out, data.size());
+  size_t start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  put_be32(out, crc32(out.data() + start, out.size() - start));
+}
+
+// A zlib stream of stored blocks, so no deflate implementation is needed
+static void encode_png(const uint32_t *argb, int width, int height,
+                       vector<uint8_t> &out) {
+  static const uint8_t sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  out.insert(out.end(), sig, sig + 8);
+  vector<uint8_t> ihdr;
+  put_be32(ihdr, width);
+  put_be32(ihdr, height);
+  ihdr.push_back(8); // bit depth
+  ihdr.push_back(2); // truecolour
+  ihdr.push_back(0);
+  ihdr.push_back(0);
+  ihdr.push_back(0);
+  png_chunk(out, "IHDR", ihdr);
+
+  vector<uint8_t> raw;
+  raw.reserve(height * (1 + 3 * width));
+  for (int y = 0; y < height; y++) {
+    raw.push_back(0); // no filter
+    for (int x = 0; x < width; x++) {
+      uint32_t p = argb[y * width + x];
+      raw.push_back((p >> 16) & 0xFF);
+      raw.push_back((p >> 8) & 0xFF);
+      raw.push_back(p & 0xFF);
+    }
+  }
+  vector<uint8_t> idat;
+  idat.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+  idat.push_back(0x78);
+  idat.push_back(0x01);
+  size_t pos = 0;
+  do {
+    size_t len = min<size_t>(raw.size() - pos, 65535);
+    idat.push_back((pos + len == raw.size()) ? 1 : 0);
+    put_le(idat, len, 2);
+    put_le(idat, ~len & 0xFFFF, 2);
+    idat.insert(idat.end(), raw.begin() + pos, raw.begin() + pos + len);
+    pos += len;
+  } while (pos < raw.size());
+  uint32_t a = 1, b = 0;
+  for (uint8_t x : raw) {
+    a = (a + x) % 65521;
+    b = (b + a) % 65521;
+  }
+  put_be32(idat, (b << 16) | a);
+  png_chunk(out, "IDAT", idat);
+  png_chunk(out, "IEND", vector<uint8_t>());
+}
+
+static void encode_y4m(const uint32_t *argb, int width, int height,
+                       vector<uint8_t> &out) {
+  static const char hdr[] = "FRAME\n";
+  out.insert(out.end(), hdr, hdr + 6);
+  size_t n = size_t(width) * height, base = out.size();
+  out.resize(base + 3 * n);
+  uint8_t *y = &out[base], *u = y + n, *v = u + n;
+  for (size_t i = 0; i < n; i++) {
+    int r = (argb[i] >> 16) & 0xFF, g = (argb[i] >> 8) & 0xFF,
+        b = argb[i] & 0xFF;
+    y[i] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+    u[i] = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+    v[i] = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+  }
+}
+
+void frame_encode(FrameFormat fmt, const uint32_t *argb, int width, int height,
+                  vector<uint8_t> &out) {
+  out.clear();
+  switch (fmt) {
+  case FrameFormat::BMP:
+    encode_bmp(argb, width, height, out);
+    break;
+  case FrameFormat::PNG:
+    encode_png(argb, width, height, out);
+    break;
+  case FrameFormat::Y4M:
+    encode_y4m(argb, width, height, out);
+    break;
+  case FrameFormat::RGB:
+    out.reserve(size_t(width) * height * 3);
+    for (int i = 0; i < width * height; i++) {
+      out.push_back((argb[i] >> 16) & 0xFF);
+      out.push_back((argb[i] >> 8) & 0xFF);
+      out.push_back(argb[i] & 0xFF);
+    }
+    break;
+  }
+}
+
+FrameWriter::FrameWriter(int queue_len) : queue_len(queue_len) {
+  writer = thread([this]() { worker(); });
+}
+
+FrameWriter::~FrameWriter() {
+  close_sequence();
+  {
+    lock_guard<mutex> lk(m);
+    quit = true;
+  }
+  queue_cv.notify_one();
+  writer.join();
+}
+
+void FrameWriter::submit(Job &&job) {
+  unique_lock<mutex> lk(m);
+  space_cv.wait(lk, [this]() { return queue.size() < queue_len; });
+  queue.push_back(move(job));
+  queue_cv.notify_one();
+}
+
+void FrameWriter::worker() {
+  vector<uint8_t> image_data;
+  while (true) {
+    Job job;
+    {
+      unique_lock<mutex> lk(m);
+      queue_cv.wait(lk, [this]() { return !queue.empty() || quit; });
+      if (queue.empty())
+        return;
+      job = move(queue.front());
+      queue.pop_front();
+      busy = true;
+    }
+    space_cv.notify_one();
+    vector<uint8_t> &data = job.sequence ? seq_data : image_data;
+    if (!job.repeat)
+      frame_encode(job.fmt, job.pixels.data(), job.width, job.height, data);
+    if (job.filename.empty()) {
+      if (fwrite(data.data(), 1, data.size(), seq_file) != data.size())
+        cerr << "Failed to write frame to " << seq_name << endl;
+    } else {
+      FILE *f = fopen(job.filename.c_str(), "wb");
+      if (f == nullptr || fwrite(data.data(), 1, data.size(), f) != data.size())
+        cerr << "Failed to write " << job.filename << endl;
+      if (f != nullptr)
+        fclose(f);
+    }
+    {
+      lock_guard<mutex> lk(m);
+      frames_written++;
+      busy = false;
+    }
+    idle_cv.notify_all();
+  }
+}
+
+void FrameWriter::wait_idle() {
+  unique_lock<mutex> lk(m);
+  idle_cv.wait(lk, [this]() { return queue.empty() && !busy; });
+}
+
+void FrameWriter::write_image(const string &filename, FrameFormat fmt,
+                              const uint32_t *argb, int width, int height) {
+  Job job;
+  job.filename = filename;
+  job.fmt = fmt;
+  job.width = width;
+  job.height = height;
+  job.pixels.assign(argb, argb + width * height);
+  submit(move(job));
+}
+
+bool FrameWriter::open_sequence(const string &filename, FrameFormat fmt,
+                                int width, int height, double fps) {
+  close_sequence();
+  seq_name = filename;
+  seq_fmt = fmt;
+  seq_width = width;
+  seq_height = height;
+  seq_frames = 0;
+  seq_data.clear();
+  if (!frame_format_is_stream(fmt))
+    return true;
+  seq_file = fopen(filename.c_str(), "wb");
+  if (seq_file == nullptr) {
+    cerr << "Failed to open " << filename << endl;
+    return false;
+  }
+  if (fmt == FrameFormat::Y4M)
+    fprintf(seq_file, "YUV4MPEG2 W%d H%d F%ld:1000 Ip A1:1 C444\n", width,
+            height, lround(fps * 1000));
+  return true;
+}
+
+void FrameWriter::write_frame(const uint32_t *argb, uint64_t number,
+                              bool repeat) {
+  Job job;
+  job.sequence = true;
+  job.repeat = repeat && seq_frames > 0;
+  if (!frame_format_is_stream(seq_fmt)) {
+    char num[32];
+    snprintf(num, sizeof(num), "_%06llu", (unsigned long long)number);
+    size_t dot = seq_name.rfind('.');
+    job.filename = seq_name.substr(0, dot) + num + seq_name.substr(dot);
+  }
+  job.fmt = seq_fmt;
+  job.width = seq_width;
+  job.height = seq_height;
+  if (!job.repeat)
+    job.pixels.assign(argb, argb + seq_width * seq_height);
+  seq_frames++;
+  submit(move(job));
+}
+
+void FrameWriter::close_sequence() {
+  wait_idle();
+  if (seq_file != nullptr)
+    fclose(seq_file);
+  seq_file = nullptr;
+  seq_name.clear();
+}
+
+uint64_t FrameWriter::get_frames_written() {
+  lock_guard<mutex> lk(m);
+  return frames_written;
+}
+
+} // namespace VTxx
@@ -0,0 +1,84 @@
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+// Image formats are written one frame per file, stream formats append every
+// frame to one file (which may be a FIFO read by an encoder):
+//   BMP  24-bit uncompressed
+//   PNG  24-bit, with stored (uncompressed) deflate blocks
+//   Y4M  YUV4MPEG2, 4:4:4 BT.601 limited range
+//   RGB  raw RGB24 with no header
+enum class FrameFormat { BMP, PNG, Y4M, RGB };
+
+// Pick a format from a file extension, returning false if unknown
+bool frame_format_from_name(const string &filename, FrameFormat &fmt);
+inline bool frame_format_is_stream(FrameFormat fmt) {
+  return fmt == FrameFormat::Y4M || fmt == FrameFormat::RGB;
+}
+// Encode one ARGB8888 frame as a BMP or PNG file, or a Y4M or RGB frame
+void frame_encode(FrameFormat fmt, const uint32_t *argb, int width, int height,
+                  vector<uint8_t> &out);
+
+// Encodes and writes frames on a background thread. Frames are copied into a
+// bounded queue, and submitting blocks while it is full, so nothing is
+// dropped
+class FrameWriter {
+public:
+  FrameWriter(int queue_len = 8);
+  // Waits for queued frames to be written
+  ~FrameWriter();
+  // Write a single BMP or PNG image
+  void write_image(const string &filename, FrameFormat fmt,
+                   const uint32_t *argb, int width, int height);
+  // Start a sequence written by write_frame: numbered image files named after
+  // filename for BMP and PNG, or one file for Y4M and RGB
+  bool open_sequence(const string &filename, FrameFormat fmt, int width,
+                     int height, double fps);
+  // Add a frame to the sequence, number is used to name image files. If repeat
+  // is set the frame is the same as the last one, and its encoding is reused
+  void write_frame(const uint32_t *argb, uint64_t number, bool repeat = false);
+  // Wait for queued frames to be written and close the sequence
+  void close_sequence();
+  uint64_t get_frames_written();
+
+private:
+  struct Job {
+    string filename; // empty to append to the sequence stream
+    bool sequence = false, repeat = false;
+    FrameFormat fmt;
+    int width, height;
+    vector<uint32_t> pixels;
+  };
+  void submit(Job &&job);
+  void worker();
+  void wait_idle();
+
+  thread writer;
+  mutex m;
+  condition_variable queue_cv, space_cv, idle_cv;
+  deque<Job> queue;
+  size_t queue_len;
+  bool busy = false, quit = false;
+  uint64_t frames_written = 0;
+
+  // Current sequence, the stream is only touched by the worker while open
+  string seq_name;
+  FrameFormat seq_fmt = FrameFormat::BMP;
+  int seq_width = 0, seq_height = 0;
+  FILE *seq_file = nullptr;
+  uint64_t seq_frames = 0;
+  // Encoding of the last sequence frame, only touched by the worker while open
+  vector<uint8_t> seq_data;
+};
+} // namespace VTxx
+
+#endif /* end of include guard: FRAMEWRITER_H */
@@ -8,19 +8,24 @@ IRQController::IRQController(const vector<IRQVector> &_v,
                              mos6502::mos6502 *_cpu)
     : n(_v.size()), vectors(_v), cpu(_cpu) {
   status.resize(n, false);
+  for (int i = 0; i < n; i++)
+    cpu->SetIRQVector(i, vectors[i].h, vectors[i].l);
 };
 
 void IRQController::write(uint8_t address, uint8_t data) {
   msk_reg = data;
   for (int i = 0; i < n; i++) // check this
-    if (!get_bit(msk_reg, i))
+    if (!get_bit(msk_reg, i) && status[i]) {
       status[i] = false;
+      cpu->SetIRQLine(i, false);
+    }
 }
 uint8_t IRQController::read(uint8_t address) { return msk_reg; }
 void IRQController::set_irq(int idx, bool new_status) {
   assert(idx < n);
   if (!new_status) {
     status[idx] = false;
+    cpu->SetIRQLine(idx, false);
   } else {
     if (get_bit(msk_reg, idx)) {
       if (!status[idx]) {
@@ -28,7 +33,7 @@ void IRQController::set_irq(int idx, bool new_status) {
         // cout << "--- IRQ " << idx << " (0x" << hex << vectors[idx].h << ",
         // 0x"
         //     << vectors[idx].l << ")" << endl;
-        cpu->IRQ(vectors[idx].h, vectors[idx].l);
+        cpu->SetIRQLine(idx, true);
       }
     }
   }
@@ -0,0 +1,186 @@
+#include "lockstep.hpp"
+#include "6502/mos6502.hpp"
+#include "mmu.hpp"
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+
+bool lockstep_enabled = false;
+
+struct BusAccess {
+  uint16_t addr;
+  uint8_t data;
+};
+
+static mos6502::mos6502 *cpu = nullptr, *ref = nullptr;
+static vector<BusAccess> cpu_reads, cpu_writes, ref_reads, ref_writes;
+static size_t replay_pos = 0;
+static bool ref_bus_error = false;
+static uint64_t count = 0;
+// The instruction's bytes as they were before the real core ran it, as it may
+// overwrite them or switch the bank they are in
+static uint16_t instr_pc = 0;
+static uint8_t instr_bytes[3];
+static bool instr_valid = false;
+// PCs of the last instructions checked, for the divergence dump
+static const int trail_len = 16;
+static uint16_t pc_trail[trail_len];
+
+// Reads of ROM space have no side effects, so the reference may read them
+// directly when the real core didn't (for example if it used a decode cache)
+static bool is_pure(uint16_t addr) { return addr >= 0x4000; }
+
+static uint8_t cpu_read(uint16_t addr) {
+  uint8_t d = read_mem_virtual(addr);
+  cpu_reads.push_back({addr, d});
+  return d;
+}
+
+static void cpu_write(uint16_t addr, uint8_t data) {
+  cpu_writes.push_back({addr, data});
+  write_mem_virtual(addr, data);
+}
+
+static uint8_t ref_read(uint16_t addr) {
+  while (replay_pos < cpu_reads.size() && cpu_reads[replay_pos].addr != addr &&
+         is_pure(cpu_reads[replay_pos].addr))
+    replay_pos++;
+  uint8_t d = 0;
+  if (replay_pos < cpu_reads.size() && cpu_reads[replay_pos].addr == addr)
+    d = cpu_reads[replay_pos++].data;
+  else if (instr_valid && uint16_t(addr - instr_pc) < 3)
+    d = instr_bytes[uint16_t(addr - instr_pc)];
+  else if (is_pure(addr))
+    d = peek_mem_virtual(addr);
+  else
+    ref_bus_error = true;
+  ref_reads.push_back({addr, d});
+  return d;
+}
+
+static void ref_write(uint16_t addr, uint8_t data) {
+  ref_writes.push_back({addr, data});
+}
+
+static void dump_state(const char *name, const mos6502::mos6502::State &s) {
+  cerr << "  " << setw(10) << left << name << right << hex << setfill('0')
+       << "PC=" << setw(4) << s.pc << " A=" << setw(2) << int(s.A)
+       << " X=" << setw(2) << int(s.X) << " Y=" << setw(2) << int(s.Y)
+       << " SP=" << setw(2) << int(s.sp) << " P=" << setw(2) << int(s.status)
+       << " IRQ=" << s.irqLines << setfill(' ') << dec << endl;
+}
+
+static void dump_accesses(const char *name, const vector<BusAccess> &v) {
+  cerr << "  " << name << ":" << hex << setfill('0');
+  for (auto &a : v)
+    cerr << " " << setw(4) << a.addr << "=" << setw(2) << int(a.data);
+  cerr << setfill(' ') << dec << endl;
+}
+
+static void diverged(const char *what, const mos6502::mos6502::State &before) {
+  cerr << "lockstep: " << what << " after " << count << " instructions" << endl;
+  dump_state("before", before);
+  dump_state("cpu", cpu->GetState());
+  dump_state("reference", ref->GetState());
+  cerr << "  at " << va_to_str(before.pc) << endl;
+  dump_accesses("cpu reads", cpu_reads);
+  dump_accesses("ref reads", ref_reads);
+  dump_accesses("cpu writes", cpu_writes);
+  dump_accesses("ref writes", ref_writes);
+  cerr << "  recent PCs:" << hex;
+  for (int i = 0; i < trail_len && i < int(count); i++)
+    cerr << " " << pc_trail[(count - 1 - i) % trail_len];
+  cerr << dec << endl;
+  // Skip static destructors, other threads may still be waiting on them
+  cout.flush();
+  _Exit(3);
+}
+
+static bool same_state(const mos6502::mos6502::State &a,
+                       const mos6502::mos6502::State &b) {
+  return a.A == b.A && a.X == b.X && a.Y == b.Y && a.sp == b.sp &&
+         a.status == b.status && a.pc == b.pc;
+}
+
+static bool same_writes() {
+  if (cpu_writes.size() != ref_writes.size())
+    return false;
+  for (size_t i = 0; i < cpu_writes.size(); i++)
+    if (cpu_writes[i].addr != ref_writes[i].addr ||
+        cpu_writes[i].data != ref_writes[i].data)
+      return false;
+  return true;
+}
+
+static void check(const mos6502::mos6502::State &before) {
+  while (replay_pos < cpu_reads.size() && is_pure(cpu_reads[replay_pos].addr))
+    replay_pos++;
+  if (ref_bus_error || replay_pos != cpu_reads.size())
+    diverged("read streams differ", before);
+  if (!same_writes())
+    diverged("write streams differ", before);
+  if (!same_state(cpu->GetState(), ref->GetState()))
+    diverged("registers differ", before);
+  pc_trail[count % trail_len] = before.pc;
+  count++;
+}
+
+static void begin() {
+  cpu_reads.clear();
+  cpu_writes.clear();
+  ref_reads.clear();
+  ref_writes.clear();
+  replay_pos = 0;
+  ref_bus_error = false;
+  instr_valid = false;
+}
+
+void lockstep_start(mos6502::mos6502 *c) {
+  cpu = c;
+  if (ref == nullptr)
+    ref = new mos6502::mos6502(ref_read, ref_write);
+  ref->CopyConfig(*cpu);
+  begin();
+  ref->Reset();
+  ref->SetState(cpu->GetState());
+  cpu->SetBus(cpu_read, cpu_write);
+  count = 0;
+  lockstep_enabled = true;
+}
+
+void lockstep_step() {
+  mos6502::mos6502::State before = cpu->GetState();
+  begin();
+  instr_pc = before.pc;
+  for (int i = 0; i < 3; i++)
+    instr_bytes[i] = peek_mem_virtual(uint16_t(instr_pc + i));
+  instr_valid = is_pure(instr_pc);
+  cpu->Run(1);
+  // IRQ lines may have changed since the last instruction
+  mos6502::mos6502::State rs = ref->GetState();
+  rs.irqLines = before.irqLines;
+  ref->SetState(rs);
+  ref->Run(1);
+  check(before);
+}
+
+void lockstep_nmi() {
+  mos6502::mos6502::State before = cpu->GetState();
+  begin();
+  cpu->NMI();
+  ref->NMI();
+  check(before);
+}
+
+void lockstep_resync() {
+  begin();
+  ref->SetState(cpu->GetState());
+}
+
+uint64_t lockstep_get_count() { return count; }
+
+} // namespace VTxx
@@ -0,0 +1,27 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+#include <cstdint>
+
+namespace mos6502 {
+class mos6502;
+};
+
+namespace VTxx {
+// Differential validation of the main CPU. A plain reference core runs
+// alongside the real one, its reads replayed from what the real core read, and
+// after every instruction the registers and memory writes of the two are
+// compared. On the first divergence the context is dumped to stderr and the
+// process exits with status 3
+extern bool lockstep_enabled;
+
+// Start validating cpu, which must be set up as the main CPU
+void lockstep_start(mos6502::mos6502 *cpu);
+// Use these in place of cpu->Run(1) and cpu->NMI() while enabled
+void lockstep_step();
+void lockstep_nmi();
+// Copy the state of the real core to the reference, after a reset
+void lockstep_resync();
+uint64_t lockstep_get_count();
+} // namespace VTxx
+
+#endif /* end of include guard: LOCKSTEP_H */
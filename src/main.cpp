@@ -1,19 +1,103 @@
 #include "SDL2/SDL.h"
+#include "audio.hpp"
+#include "bench.hpp"
+#include "capture.hpp"
+#include "debug.hpp"
+#include "framewriter.hpp"
 #include "loadui.hpp"
 #include "mmu.hpp"
+#include "overlay.hpp"
+#include "pacing.hpp"
 #include "ppu.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "viewer.hpp"
 #include "vt168.hpp"
+#include <atomic>
+#include <chrono>
 #include <ctime>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
 using namespace std;
 using namespace VTxx;
 
 SDL_Window *ppu_window;
 SDL_Renderer *ppuwin_renderer;
+SDL_Texture *ppu_texture;
+
+// Emulation runs on its own thread, while this thread presents frames and
+// polls input at the display rate. Anything that touches emulator state from
+// the UI thread is posted as a command and run at the next vblank
+static thread emu_thread;
+static atomic<bool> emu_quit(false);
+static mutex emu_cmd_mutex;
+static vector<function<void()>> emu_cmds;
+// Target frame rate, 0 to run unthrottled or -1 for the region's rate
+static double target_fps = -1;
+// Speed multiplier while the fast forward key is held
+static double ff_speed = 4;
+static FramePacer pacer;
+static bool fast_forward = false;
+// Pace to the audio device rather than the wall clock, keeping this much audio
+// queued
+static bool audio_sync = false;
+static const double audio_latency_s = 0.05;
+
+static void post_emu_cmd(function<void()> fn) {
+  lock_guard<mutex> lk(emu_cmd_mutex);
+  emu_cmds.push_back(fn);
+}
+
+static void emu_loop() {
+  pacer.set_rate(target_fps);
+  while (!emu_quit) {
+    while (!vt168_tick())
+      ;
+    vector<function<void()>> cmds;
+    {
+      lock_guard<mutex> lk(emu_cmd_mutex);
+      swap(cmds, emu_cmds);
+    }
+    for (auto &cmd : cmds)
+      cmd();
+    if (audio_sync && !fast_forward)
+      pace_to_audio(size_t(audio_get_rate() * audio_latency_s));
+    else
+      pacer.wait_frame();
+  }
+}
+
+// Stop the threads started during setup, for errors after vt168_init
+static int setup_failed() {
+  debug_close();
+  vt168_stop();
+  trace_close();
+  audio_close();
+  ppu_stop();
+  return 1;
+}
+
+static string timestamp() {
+  char timestring[30];
+  time_t now = time(nullptr);
+  strftime(timestring, 29, "%Y%m%d_%H%M%S", localtime(&now));
+  return string(timestring);
+}
 
 int main(int argc, char *argv[]) {
   std::string plat_str, rom_str;
+  bool bench = false;
+  BenchConfig bench_cfg;
+  VT168_Region region = VT168_Region::PAL;
+  bool enable_audio = true;
+  float volume = 1.0f;
+  bool resampler_set = false;
+  string trace_file;
+  TraceCond trace_start, trace_stop;
   if (argc < 3) {
     LoadData d = show_load_ui(argc, argv);
     plat_str = d.platform;
@@ -21,15 +105,99 @@ int main(int argc, char *argv[]) {
   } else {
     plat_str = argv[1];
     rom_str = argv[2];
+    for (int i = 3; i < argc; i++) {
+      string arg = argv[i];
+      if (arg == "--bench" && (i + 1) < argc) {
+        bench = true;
+        bench_cfg.frames = stoi(argv[++i]);
+      } else if (arg == "--no-render") {
+        bench_cfg.render_policy = RenderPolicy::OFF;
+      } else if (arg == "--render" && (i + 1) < argc) {
+        string r = argv[++i];
+        if (r == "full") {
+          bench_cfg.render_policy = RenderPolicy::FULL;
+        } else if (r.compare(0, 6, "every:") == 0 && r.size() > 6) {
+          bench_cfg.render_policy = RenderPolicy::EVERY_N;
+          bench_cfg.render_every = max(stoi(r.substr(6)), 1);
+        } else if (r == "demand") {
+          bench_cfg.render_policy = RenderPolicy::ON_DEMAND;
+        } else if (r == "off") {
+          bench_cfg.render_policy = RenderPolicy::OFF;
+        } else {
+          cerr << "Render policies: full every:N demand off" << endl;
+          return 2;
+        }
+      } else if (arg == "--render-threads" && (i + 1) < argc) {
+        bench_cfg.render_threads = stoi(argv[++i]);
+      } else if (arg == "--no-line-reuse") {
+        bench_cfg.line_reuse = false;
+      } else if (arg == "--cpu-cache") {
+        bench_cfg.cpu_cache = true;
+      } else if (arg == "--cpu-cache-check") {
+        bench_cfg.cpu_cache = bench_cfg.cpu_cache_check = true;
+      } else if (arg == "--lockstep") {
+        bench_cfg.lockstep = true;
+      } else if (arg == "--debug" && (i + 1) < argc) {
+        bench_cfg.debug_socket = argv[++i];
+      } else if (arg == "--capture" && (i + 1) < argc) {
+        bench_cfg.capture_file = argv[++i];
+      } else if (arg == "--scpu-thread") {
+        bench_cfg.scpu_thread = true;
+      } else if (arg == "--json" && (i + 1) < argc) {
+        bench_cfg.json_file = argv[++i];
+      } else if (arg == "--profile" && (i + 1) < argc) {
+        bench_cfg.profile = argv[++i];
+      } else if (arg == "--dump" && (i + 1) < argc) {
+        bench_cfg.dump_file = argv[++i];
+      } else if (arg == "--dump-every" && (i + 1) < argc) {
+        bench_cfg.dump_every = stoi(argv[++i]);
+      } else if (arg == "--fps" && (i + 1) < argc) {
+        target_fps = stod(argv[++i]);
+      } else if (arg == "--ff" && (i + 1) < argc) {
+        ff_speed = stod(argv[++i]);
+      } else if (arg == "--no-audio") {
+        enable_audio = false;
+      } else if (arg == "--audio-sync") {
+        audio_sync = true;
+      } else if (arg == "--volume" && (i + 1) < argc) {
+        volume = stof(argv[++i]);
+      } else if (arg == "--resampler" && (i + 1) < argc) {
+        string r = argv[++i];
+        resampler_set = true;
+        if (r == "sinc") {
+          bench_cfg.resampler = ResampleMode::SINC;
+        } else if (r == "linear") {
+          bench_cfg.resampler = ResampleMode::LINEAR;
+        } else {
+          cerr << "Supported resamplers: sinc linear" << endl;
+          return 2;
+        }
+      } else if (arg == "--trace" && (i + 1) < argc) {
+        trace_file = argv[++i];
+      } else if ((arg == "--trace-start" || arg == "--trace-stop") &&
+                 (i + 1) < argc) {
+        if (!trace_parse_cond(argv[++i], (arg == "--trace-start")
+                                             ? trace_start
+                                             : trace_stop)) {
+          cerr << "Trace conditions: pc:ADDR frame:N write:ADDR" << endl;
+          return 2;
+        }
+      } else if (arg == "--region" && (i + 1) < argc) {
+        string r = argv[++i];
+        if (r == "pal") {
+          region = VT168_Region::PAL;
+        } else if (r == "ntsc") {
+          region = VT168_Region::NTSC;
+        } else {
+          cerr << "Supported regions: pal ntsc" << endl;
+          return 2;
+        }
+      } else {
+        cerr << "Unknown option " << arg << endl;
+        return 2;
+      }
+    }
   }
-  ppu_window = SDL_CreateWindow("OpenVTx v0.10", SDL_WINDOWPOS_CENTERED,
-                                SDL_WINDOWPOS_CENTERED, 256, 240, 0);
-  if (ppu_window == nullptr) {
-    printf("Failed to create window: %s.\n", SDL_GetError());
-    exit(1);
-  }
-  ppuwin_renderer =
-      SDL_CreateRenderer(ppu_window, -1, SDL_RENDERER_ACCELERATED);
   VT168_Platform plat;
   if (plat_str == "vt168") {
     plat = VT168_Platform::VT168_BASE;
@@ -39,62 +207,185 @@ int main(int argc, char *argv[]) {
     cerr << "Supported platforms: vt168 miwi2" << endl;
     return 2;
   }
-  vt168_init(plat, rom_str);
+  bench_cfg.region = region;
+  if (!bench_check_config(bench_cfg))
+    return 2;
+  if (!trace_file.empty() && !trace_open(trace_file, trace_start, trace_stop))
+    return 1;
+  if (bench) {
+    int result = run_benchmark(plat, rom_str, bench_cfg);
+    trace_close();
+    return result;
+  }
+  ppu_window = SDL_CreateWindow("OpenVTx v0.10", SDL_WINDOWPOS_CENTERED,
+                                SDL_WINDOWPOS_CENTERED, 256, 240, 0);
+  if (ppu_window == nullptr) {
+    printf("Failed to create window: %s.\n", SDL_GetError());
+    exit(1);
+  }
+  ppuwin_renderer = SDL_CreateRenderer(
+      ppu_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+  // Created once and updated in place every frame
+  ppu_texture =
+      SDL_CreateTexture(ppuwin_renderer, SDL_PIXELFORMAT_ARGB8888,
+                        SDL_TEXTUREACCESS_STREAMING, 256, 240);
+  if (ppu_texture == nullptr) {
+    printf("Failed to create texture: %s.\n", SDL_GetError());
+    exit(1);
+  }
+  // Interactive runs default to the better resampler
+  vt168_set_audio_output(volume, resampler_set ? bench_cfg.resampler
+                                               : ResampleMode::SINC);
+  if (enable_audio && !audio_open(48000))
+    cerr << "Continuing without audio" << endl;
+  if (!audio_is_open())
+    audio_sync = false;
+  vt168_init(plat, rom_str, region);
+  ppu_set_render_policy(bench_cfg.render_policy, bench_cfg.render_every);
+  ppu_set_render_threads(bench_cfg.render_threads);
+  ppu_set_line_reuse(bench_cfg.line_reuse);
+  vt168_set_scpu_thread(bench_cfg.scpu_thread);
+  vt168_set_cpu_cache(bench_cfg.cpu_cache, bench_cfg.cpu_cache_check);
+  if (bench_cfg.lockstep)
+    vt168_start_lockstep();
+  if (!bench_cfg.debug_socket.empty() &&
+      !vt168_start_debugger(bench_cfg.debug_socket))
+    return setup_failed();
+  if (!bench_cfg.capture_file.empty() &&
+      !vt168_start_capture(bench_cfg.capture_file))
+    return setup_failed();
+  if (target_fps < 0)
+    target_fps = vt168_get_frame_rate();
   cout << "vector = 0x" << hex
-       << (read_mem_virtual(0xfffd) << 8UL | read_mem_virtual(0xfffc)) << endl;
-  bool last_render_done = false;
+       << (peek_mem_virtual(0xfffd) << 8UL | peek_mem_virtual(0xfffc)) << endl;
+  string profile_name = bench_cfg.profile;
+  if (!profile_name.empty())
+    prof_start(plat == VT168_Platform::VT168_MIWI2);
+  emu_thread = thread(emu_loop);
+
+  // While fast forwarding only render frames the window can show, unless
+  // capturing, which needs all of them
+  RenderPolicy render_policy = bench_cfg.render_policy;
+  int render_every = bench_cfg.render_every;
   SDL_Event event;
-  bool screenshot_pending = false, tiledump_pending = false;
-  while (true) {
-    vt168_tick();
-    if (ppu_is_render_done() && !last_render_done) {
+  // Encode screenshots off the main thread, so they don't cause a hitch
+  FrameWriter screenshots;
+  bool screenshot_pending = false;
+  bool show_overlay = false, shown_overlay = false;
+  uint32_t shown_version = 0;
+  bool running = true;
+  while (running) {
+    // Process events
+    while (SDL_PollEvent(&event)) {
+      if (viewer_event(event))
+        continue;
+      switch (event.type) {
+      case SDL_QUIT:
+        running = false;
+        break;
+      case SDL_WINDOWEVENT:
+        // With viewer windows open closing this one doesn't send SDL_QUIT
+        if (event.window.event == SDL_WINDOWEVENT_CLOSE)
+          running = false;
+        break;
+      case SDL_KEYDOWN:
+        if (event.key.keysym.scancode == SDL_SCANCODE_TAB &&
+            !event.key.repeat)
+          post_emu_cmd([render_policy]() {
+            fast_forward = true;
+            pacer.set_speed(ff_speed);
+            if (!capture_armed && render_policy != RenderPolicy::OFF)
+              ppu_set_render_policy(RenderPolicy::ON_DEMAND);
+          });
+        if (event.key.keysym.scancode == SDL_SCANCODE_R)
+          post_emu_cmd(vt168_reset);
+        if (event.key.keysym.scancode == SDL_SCANCODE_F12)
+          screenshot_pending = true;
+        if (event.key.keysym.scancode == SDL_SCANCODE_F11) {
+          // The dump reads VRAM and registers, so runs on the emulation thread
+          string name = string("tilemap_") + timestamp();
+          post_emu_cmd([name]() { ppu_dump_tilemaps(name); });
+        }
+        if (event.key.keysym.scancode == SDL_SCANCODE_F10)
+          show_overlay = !show_overlay;
+        if (event.key.keysym.scancode >= SDL_SCANCODE_F2 &&
+            event.key.keysym.scancode <= SDL_SCANCODE_F6)
+          viewer_toggle(
+              PPUView(event.key.keysym.scancode - SDL_SCANCODE_F2));
+        if (event.key.keysym.scancode == SDL_SCANCODE_F8) {
+          post_emu_cmd([plat, &profile_name]() {
+            if (prof_enabled) {
+              prof_stop(profile_name);
+            } else {
+              profile_name = string("profile_") + timestamp();
+              prof_start(plat == VT168_Platform::VT168_MIWI2);
+            }
+          });
+        }
+        break;
+      case SDL_KEYUP:
+        if (event.key.keysym.scancode == SDL_SCANCODE_TAB)
+          post_emu_cmd([render_policy, render_every]() {
+            fast_forward = false;
+            pacer.set_speed(1);
+            ppu_set_render_policy(render_policy, render_every);
+          });
+        break;
+      }
+      SDL_Event ev = event;
+      post_emu_cmd([ev]() mutable { vt168_process_event(&ev); });
+    }
+    bool new_frame = ppu_acquire_frame();
+    if (new_frame) {
+      // Only has an effect while rendering on demand
+      ppu_request_frame();
       if (screenshot_pending) {
         screenshot_pending = false;
-        char timestring[30];
-        time_t now = time(nullptr);
-        strftime(timestring, 29, "%Y%m%d_%H%M%S", localtime(&now));
-        string filename =
-            string("screenshot_") + string(timestring) + string(".bmp");
-        ppu_write_screenshot(filename);
+        screenshots.write_image(string("screenshot_") + timestamp() +
+                                    string(".bmp"),
+                                FrameFormat::BMP, get_render_buffer(), 256,
+                                240);
       }
-      if (tiledump_pending) {
-        tiledump_pending = false;
-        char timestring[30];
-        time_t now = time(nullptr);
-        strftime(timestring, 29, "%Y%m%d_%H%M%S", localtime(&now));
-        string filename = string("tilemap_") + string(timestring);
-        ppu_dump_tilemaps(filename);
-      }
-      // Process events
-      while (SDL_PollEvent(&event)) {
-        switch (event.type) {
-        case SDL_QUIT:
-          ppu_stop();
-          return 0;
-          break;
-        case SDL_KEYDOWN:
-          if (event.key.keysym.scancode == SDL_SCANCODE_R)
-            vt168_reset();
-          if (event.key.keysym.scancode == SDL_SCANCODE_F12)
-            screenshot_pending = true;
-          if (event.key.keysym.scancode == SDL_SCANCODE_F11)
-            tiledump_pending = true;
-          break;
+      // Render graphics, unless the texture already holds this frame
+      void *pixels;
+      int pitch;
+      uint32_t version = ppu_get_frame_version();
+      bool redraw = version != shown_version || show_overlay || shown_overlay;
+      if (redraw &&
+          SDL_LockTexture(ppu_texture, nullptr, &pixels, &pitch) == 0) {
+        uint32_t *src = get_render_buffer();
+        uint8_t *dst = reinterpret_cast<uint8_t *>(pixels);
+        for (int y = 0; y < 240; y++)
+          copy(src + (y * 256), src + ((y + 1) * 256),
+               reinterpret_cast<uint32_t *>(dst + (y * pitch)));
+        if (show_overlay) {
+          overlay_update(vt168_get_stats());
+          overlay_draw(reinterpret_cast<uint32_t *>(pixels), 256, 240,
+                       pitch / 4);
         }
-        vt168_process_event(&event);
+        SDL_UnlockTexture(ppu_texture);
+        shown_version = version;
+        shown_overlay = show_overlay;
       }
-      // Render graphics
-      SDL_Surface *surf = SDL_CreateRGBSurfaceFrom(
-          (void *)get_render_buffer(), 256, 240, 32, 256 * 4, 0x00FF0000,
-          0x0000FF00, 0x000000FF, 0xFF000000);
-
-      SDL_Texture *tex = SDL_CreateTextureFromSurface(ppuwin_renderer, surf);
-      SDL_RenderClear(ppuwin_renderer);
-      SDL_RenderCopy(ppuwin_renderer, tex, nullptr, nullptr);
-      SDL_RenderPresent(ppuwin_renderer);
-      SDL_DestroyTexture(tex);
-      SDL_FreeSurface(surf);
+      viewer_update();
     }
-    last_render_done = ppu_is_render_done();
+    SDL_RenderClear(ppuwin_renderer);
+    SDL_RenderCopy(ppuwin_renderer, ppu_texture, nullptr, nullptr);
+    SDL_RenderPresent(ppuwin_renderer);
+    // Present normally waits for vsync, but don't spin if it doesn't
+    if (!new_frame)
+      SDL_Delay(1);
   }
+  viewer_close_all();
+  emu_quit = true;
+  debug_close();
+  emu_thread.join();
+  vt168_stop();
+  trace_close();
+  audio_close();
+  ppu_stop();
+  capture_close();
+  if (prof_enabled)
+    prof_stop(profile_name);
+  return 0;
 }
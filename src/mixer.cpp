@@ -0,0 +1,189 @@
+#include "mixer.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace VTxx {
+
+// Filter length in input samples, and the number of fractional positions it
+// is tabulated at
+static const int sinc_taps = 32;
+static const int sinc_half = sinc_taps / 2;
+static const int sinc_phases = 256;
+
+Mixer::Mixer(double in_rate, int out_rate, int channels, ResampleMode mode)
+    : channels(channels), mode(mode), in_rate(in_rate), out_rate(out_rate) {
+  step = in_rate / out_rate;
+  gain_l.resize(channels, 1.0f);
+  gain_r.resize(channels, 1.0f);
+  mix_l.resize(sinc_taps, 0.0f);
+  mix_r.resize(sinc_taps, 0.0f);
+  pos = sinc_half;
+  build_sinc();
+}
+
+void Mixer::set_channel(int ch, float volume, float pan) {
+  assert(ch < channels);
+  pan = min(max(pan, -1.0f), 1.0f);
+  gain_l[ch] = volume * min(1.0f, 1.0f - pan);
+  gain_r[ch] = volume * min(1.0f, 1.0f + pan);
+}
+
+void Mixer::set_mode(ResampleMode m) { mode = m; }
+
+// Blackman windowed sinc, low pass at 90% of the lower Nyquist frequency
+void Mixer::build_sinc() {
+  const double pi = 3.14159265358979323846;
+  double fc = 0.45 * min(1.0, 1.0 / step);
+  sinc_table.resize(sinc_phases * sinc_taps);
+  for (int p = 0; p < sinc_phases; p++) {
+    float *h = &sinc_table[p * sinc_taps];
+    double frac = double(p) / sinc_phases, sum = 0;
+    for (int j = 0; j < sinc_taps; j++) {
+      double x = frac - (j - sinc_half + 1);
+      double u = x / sinc_half;
+      double w = (fabs(u) >= 1)
+                     ? 0
+                     : (0.42 + 0.5 * cos(pi * u) + 0.08 * cos(2 * pi * u));
+      double s = (x == 0) ? 1.0 : sin(2 * pi * fc * x) / (2 * pi * fc * x);
+      h[j] = float(2 * fc * s * w);
+      sum += h[j];
+    }
+    for (int j = 0; j < sinc_taps; j++)
+      h[j] = float(h[j] / sum);
+  }
+}
+
+static inline float dot(const float *a, const float *b, int n) {
+#ifdef __SSE2__
+  __m128 acc = _mm_setzero_ps();
+  for (int i = 0; i < n; i += 4)
+    acc = _mm_add_ps(acc,
+                     _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+  return _mm_cvtss_f32(acc);
+#else
+  float acc = 0;
+  for (int i = 0; i < n; i++)
+    acc += a[i] * b[i];
+  return acc;
+#endif
+}
+
+// Accumulate x * g into dst
+static inline void mix_into(float *dst, const float *x, float g, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128 gv = _mm_set1_ps(g);
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i),
+                                      _mm_mul_ps(_mm_loadu_ps(x + i), gv)));
+#endif
+  for (; i < n; i++)
+    dst[i] += x[i] * g;
+}
+
+static inline int16_t to_s16(float x) {
+  return int16_t(min(max(lrintf(x), -32768L), 32767L));
+}
+
+void Mixer::process(const float *const *in, int len, vector<int16_t> &out) {
+  size_t start = mix_l.size();
+  mix_l.resize(start + len, 0.0f);
+  mix_r.resize(start + len, 0.0f);
+  for (int c = 0; c < channels; c++) {
+    mix_into(&mix_l[start], in[c], gain_l[c], len);
+    mix_into(&mix_r[start], in[c], gain_r[c], len);
+  }
+  resample(out);
+}
+
+void Mixer::resample(vector<int16_t> &out) {
+  res_l.clear();
+  res_r.clear();
+  int size = int(mix_l.size());
+  while (true) {
+    int i0 = int(pos);
+    double frac = pos - i0;
+    if (mode == ResampleMode::SINC) {
+      int phase = int(frac * sinc_phases + 0.5);
+      if (phase == sinc_phases) {
+        phase = 0;
+        i0++;
+      }
+      if (i0 + sinc_half >= size)
+        break;
+      const float *h = &sinc_table[phase * sinc_taps];
+      int base = i0 - sinc_half + 1;
+      res_l.push_back(dot(&mix_l[base], h, sinc_taps));
+      res_r.push_back(dot(&mix_r[base], h, sinc_taps));
+    } else {
+      if (i0 + 1 >= size)
+        break;
+      float f = float(frac);
+      res_l.push_back(mix_l[i0] + (mix_l[i0 + 1] - mix_l[i0]) * f);
+      res_r.push_back(mix_r[i0] + (mix_r[i0 + 1] - mix_r[i0]) * f);
+    }
+    pos += step;
+  }
+  // Keep enough history for the filter
+  int drop = max(0, int(pos) - sinc_half);
+  mix_l.erase(mix_l.begin(), mix_l.begin() + drop);
+  mix_r.erase(mix_r.begin(), mix_r.begin() + drop);
+  pos -= drop;
+
+  int n = int(res_l.size());
+  size_t o = out.size();
+  out.resize(o + 2 * n);
+  int16_t *dst = &out[o];
+  int i = 0;
+#ifdef __SSE2__
+  // Packing saturates, then interleave left and right
+  for (; i + 4 <= n; i += 4) {
+    __m128i l = _mm_cvtps_epi32(_mm_loadu_ps(&res_l[i]));
+    __m128i r = _mm_cvtps_epi32(_mm_loadu_ps(&res_r[i]));
+    __m128i lr =
+        _mm_unpacklo_epi16(_mm_packs_epi32(l, l), _mm_packs_epi32(r, r));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2 * i), lr);
+  }
+#endif
+  for (; i < n; i++) {
+    dst[2 * i] = to_s16(res_l[i]);
+    dst[2 * i + 1] = to_s16(res_r[i]);
+  }
+}
+
+double mixer_benchmark(ResampleMode mode) {
+  const int block = 256, blocks = 2000;
+  Mixer m(26601712.0 / 256, 48000, 2, mode);
+  m.set_channel(0, 1.0f, -1.0f);
+  m.set_channel(1, 1.0f, 1.0f);
+  vector<float> ch[2];
+  uint32_t seed = 1;
+  for (int c = 0; c < 2; c++)
+    for (int i = 0; i < block; i++) {
+      seed = seed * 1103515245 + 12345;
+      ch[c].push_back(float(int16_t(seed >> 16)));
+    }
+  const float *in[2] = {ch[0].data(), ch[1].data()};
+  vector<int16_t> out;
+  out.reserve(block * 2 * 2);
+  uint64_t samples = 0;
+  auto start = chrono::steady_clock::now();
+  for (int b = 0; b < blocks; b++) {
+    out.clear();
+    m.process(in, block, out);
+    samples += out.size() / 2;
+  }
+  double ns = chrono::duration_cast<chrono::nanoseconds>(
+                  chrono::steady_clock::now() - start)
+                  .count();
+  return samples ? (ns / samples) : 0;
+}
+
+} // namespace VTxx
@@ -0,0 +1,49 @@
+#ifndef MIXER_H
+#define MIXER_H
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+enum class ResampleMode {
+  LINEAR, // cheap, for batch runs
+  SINC    // polyphase windowed sinc
+};
+
+// Block based mixer. Mono input channels are mixed to stereo with per-channel
+// volume and pan, resampled to the output rate and converted to 16-bit. Uses
+// SSE2 where available
+class Mixer {
+public:
+  Mixer(double in_rate, int out_rate, int channels, ResampleMode mode);
+  // Pan is -1 (left) to 1 (right)
+  void set_channel(int ch, float volume, float pan);
+  void set_mode(ResampleMode mode);
+  // Process len samples of each input channel, appending interleaved stereo
+  // output to out
+  void process(const float *const *in, int len, vector<int16_t> &out);
+
+private:
+  void build_sinc();
+  void resample(vector<int16_t> &out);
+  int channels;
+  ResampleMode mode;
+  double in_rate;
+  int out_rate;
+  double step; // input samples per output sample
+  vector<float> gain_l, gain_r;
+  // Mixed stereo input, including history for the filter
+  vector<float> mix_l, mix_r;
+  // Position of the next output sample in mix_l/mix_r
+  double pos;
+  // Resampled block before conversion
+  vector<float> res_l, res_r;
+  // Sinc filter table, phases x taps
+  vector<float> sinc_table;
+};
+
+// Mixer cost in ns per output sample, for benchmarking
+double mixer_benchmark(ResampleMode mode);
+} // namespace VTxx
+
+#endif /* end of include guard: MIXER_H */
@@ -1,5 +1,6 @@
 #include "mmu.hpp"
 #include "ppu.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include <cassert>
 #include <fstream>
@@ -15,6 +16,30 @@ uint8_t cpu_ram[8192] = {0};
 
 static uint8_t rom[32 * 1024 * 1024];
 
+uint64_t mmio_read_count[512] = {0};
+uint64_t mmio_write_count[512] = {0};
+SyncHandler shared_ram_hook = nullptr;
+uint32_t code_gen = 0;
+atomic<uint32_t> rom_write_gen(0);
+
+// Host pointers to the 8KB ROM pages mapped at 0x4000 .. 0xFFFF, indexed by
+// address >> 13 and rebuilt when a banking register changes. The access maps
+// are nullptr for watched pages, sending accesses through the slow path
+static uint8_t *rom_map[8] = {nullptr};
+static uint8_t *rom_access_map[8] = {nullptr};
+
+// RAM pages (256 bytes) needing more than a plain load or store
+static const uint8_t ram_sync = 0x01, ram_watch = 0x02;
+static uint8_t ram_page_flags[32] = {0};
+
+static WatchHandler watch_hook = nullptr;
+static WatchPages watch;
+static vector<bool> phys_watch;
+static bool any_phys_watch = false;
+// Registers that affect decode_address
+static bool is_bank_reg[256] = {false};
+static void update_rom_map();
+
 ReadHandler reg_read_fn[256] = {nullptr};
 WriteHandler reg_write_fn[256] = {nullptr};
 
@@ -25,12 +50,17 @@ void mmu_init() {
     reg_read_fn[i] = nullptr;
     reg_write_fn[i] = nullptr;
   }
+  for (uint8_t r : {0x00, 0x05, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x10, 0x11,
+                    0x12, 0x13, 0x18, 0x1C})
+    is_bank_reg[r] = true;
+  update_rom_map();
 }
 
 void mmu_reset() {
   for (int i = 0; i < 256; i++) {
     control_reg[i] = 0x0;
   }
+  update_rom_map();
 }
 
 void load_rom(const string &filename) {
@@ -44,6 +74,8 @@ void load_rom(const string &filename) {
   uint32_t checksum = 0;
   for (int i = 0; i < romsize; i++)
     checksum += rom[i];
+  code_gen++;
+  rom_write_gen++;
   cout << "Loaded ROM, size = " << (romsize / 1024) << "KB, checksum = " << hex
        << checksum << dec << endl;
 }
@@ -67,7 +99,7 @@ const int reg_prg_bank0_reg5_rd = 0x11;
 
 const int reg_prg_bank1_reg4_5 = 0x18;
 
-inline uint32_t decode_address(uint16_t addr) {
+uint32_t decode_address(uint16_t addr) {
   if (addr < 0x4000)
     return addr;
   uint8_t tp = 0;
@@ -176,14 +208,91 @@ inline uint32_t decode_address(uint16_t addr) {
   return pa;
 }
 
+static void update_rom_map() {
+  for (int page = 2; page < 8; page++) {
+    uint32_t pa = decode_address(page << 13);
+    rom_map[page] = rom + pa;
+    bool watched = watch.rom[page] || (any_phys_watch && phys_watch[pa >> 13]);
+    rom_access_map[page] = watched ? nullptr : rom_map[page];
+  }
+  code_gen++;
+}
+
+void mmu_set_shared_ram_hook(SyncHandler hook) {
+  shared_ram_hook = hook;
+  for (int i = 0x10; i < 0x20; i++) {
+    if (hook != nullptr)
+      ram_page_flags[i] |= ram_sync;
+    else
+      ram_page_flags[i] &= ~ram_sync;
+  }
+}
+
+void mmu_set_watch(WatchHandler hook, const WatchPages &pages) {
+  watch_hook = hook;
+  watch = pages;
+  for (int i = 0; i < 32; i++) {
+    if (pages.ram[i])
+      ram_page_flags[i] |= ram_watch;
+    else
+      ram_page_flags[i] &= ~ram_watch;
+  }
+  phys_watch.assign(sizeof(rom) >> 13, false);
+  any_phys_watch = !pages.physical.empty();
+  for (uint32_t p : pages.physical)
+    if (p < phys_watch.size())
+      phys_watch[p] = true;
+  update_rom_map();
+}
+
+static void ram_slow_access(uint16_t addr, bool write, uint8_t data) {
+  uint8_t flags = ram_page_flags[addr >> 8];
+  if (flags & ram_sync)
+    shared_ram_hook();
+  if (flags & ram_watch)
+    watch_hook(addr, false, write, data);
+}
+
+// Accesses to ROM space pages that are watched virtually or physically
+static void rom_slow_access(uint16_t addr, bool write, uint8_t data) {
+  if (watch.rom[addr >> 13])
+    watch_hook(addr, false, write, data);
+  uint32_t pa = decode_address(addr);
+  if (any_phys_watch && phys_watch[pa >> 13])
+    watch_hook(pa, true, write, data);
+}
+
+uint8_t peek_mem_virtual(uint16_t addr) {
+  if (addr < 0x2000)
+    return cpu_ram[addr];
+  else if (addr >= 0x4000)
+    return rom_map[addr >> 13][addr & 0x1FFF];
+  else if (addr >= 0x2100 && addr <= 0x21FF)
+    return control_reg[addr & 0xFF];
+  else
+    return 0;
+}
+
+uint8_t peek_mem_physical(uint32_t addr) {
+  return (addr < sizeof(rom)) ? rom[addr] : 0;
+}
+
 uint8_t read_mem_virtual(uint16_t addr) {
   if (addr < 0x2000) {
+    if (ram_page_flags[addr >> 8])
+      ram_slow_access(addr, false, 0);
     return cpu_ram[addr];
   } else if (addr >= 0x4000) {
-    return rom[decode_address(addr)];
+    uint8_t *page = rom_access_map[addr >> 13];
+    if (page != nullptr)
+      return page[addr & 0x1FFF];
+    rom_slow_access(addr, false, 0);
+    return rom_map[addr >> 13][addr & 0x1FFF];
   } else if (addr >= 0x2000 && addr <= 0x20FF) {
+    mmio_read_count[addr - 0x2000]++;
     return ppu_read(addr & 0xFF);
   } else if (addr >= 0x2100 && addr <= 0x21FF) {
+    mmio_read_count[addr - 0x2000]++;
     // if ((addr >= 0x210D) && (addr <= 0x210F))
     // cout << "IOx READ 0x" << hex << addr << endl;
     // System regs read
@@ -208,13 +317,27 @@ uint8_t read_mem_virtual(uint16_t addr) {
 
 void write_mem_virtual(uint16_t addr, uint8_t data) {
   if (addr < 0x2000) {
+    if (ram_page_flags[addr >> 8])
+      ram_slow_access(addr, true, data);
     cpu_ram[addr] = data;
   } else if (addr >= 0x4000) {
-    rom[decode_address(addr)] =
+    if (rom_access_map[addr >> 13] == nullptr)
+      rom_slow_access(addr, true, data);
+    rom_map[addr >> 13][addr & 0x1FFF] =
         data; // Seems odd but "ROM" might actually be extram
+    code_gen++;
+    rom_write_gen++;
   } else if (addr >= 0x2000 && addr <= 0x20FF) {
+    mmio_write_count[addr - 0x2000]++;
+    trace_reg_write(addr);
+    if (watch.reg_write[addr - 0x2000])
+      watch_hook(addr, false, true, data);
     ppu_write(addr & 0xFF, data);
   } else if (addr >= 0x2100 && addr <= 0x21FF) {
+    mmio_write_count[addr - 0x2000]++;
+    trace_reg_write(addr);
+    if (watch.reg_write[addr - 0x2000])
+      watch_hook(addr, false, true, data);
     // if ((addr >= 0x210D) && (addr <= 0x210F))
     // cout << "CTRL WRITE 0x" << hex << addr << " d " << int(data) << endl;
     uint8_t reg_addr = addr & 0xFF;
@@ -222,6 +345,8 @@ void write_mem_virtual(uint16_t addr, uint8_t data) {
       (reg_write_fn[reg_addr])(addr, data);
     else
       control_reg[reg_addr] = data;
+    if (is_bank_reg[reg_addr])
+      update_rom_map();
   } else {
     // Unmapped space
     assert(false);
@@ -230,11 +355,17 @@ void write_mem_virtual(uint16_t addr, uint8_t data) {
 
 uint8_t read_mem_physical(uint32_t addr) {
   assert(addr < sizeof(rom));
+  if (any_phys_watch && phys_watch[addr >> 13])
+    watch_hook(addr, true, false, 0);
   return rom[addr];
 }
 void write_mem_physical(uint32_t addr, uint8_t data) {
   assert(addr < sizeof(rom));
+  if (any_phys_watch && phys_watch[addr >> 13])
+    watch_hook(addr, true, true, data);
   rom[addr] = data;
+  code_gen++;
+  rom_write_gen++;
 }
 
 string va_to_str(uint16_t va) {
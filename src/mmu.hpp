@@ -1,8 +1,10 @@
 #ifndef MMU_H
 #define MMU_H
 #include "typedefs.hpp"
+#include <atomic>
 #include <cstdint>
 #include <string>
+#include <vector>
 using namespace std;
 namespace VTxx {
 // The system control registers, 0x2100 .. 0x21FF
@@ -17,11 +19,48 @@ void load_rom(const string &filename);
 uint8_t read_mem_virtual(uint16_t addr);
 void write_mem_virtual(uint16_t addr, uint8_t data);
 
+// Translate a virtual address >= 0x4000 to a physical ROM address using the
+// current banking registers
+uint32_t decode_address(uint16_t addr);
+
+// Bumped whenever the code visible at 0x4000 .. 0xFFFF may have changed: on
+// banking register changes and writes to ROM space (which may be extram)
+extern uint32_t code_gen;
+// Bumped on writes to ROM space only, so the PPU can tell when character data
+// may have changed. Read by the render thread
+extern atomic<uint32_t> rom_write_gen;
+
 uint8_t read_mem_physical(uint32_t addr);
 void write_mem_physical(uint32_t addr, uint8_t data);
 
 string va_to_str(uint16_t va);
 
+// Access counts for 0x2000 .. 0x21FF, indexed by address - 0x2000
+extern uint64_t mmio_read_count[512];
+extern uint64_t mmio_write_count[512];
+
+// If set, called before every main CPU access to the RAM shared with the
+// SCPU (0x1000 .. 0x1FFF)
+extern SyncHandler shared_ram_hook;
+void mmu_set_shared_ram_hook(SyncHandler hook);
+
+// Pages and registers watched by the debugger. Accesses elsewhere take the
+// normal path, so watching costs nothing on other pages
+struct WatchPages {
+  bool ram[32] = {false};        // 256 byte pages of 0x0000 .. 0x1FFF
+  bool rom[8] = {false};         // 8KB virtual pages, 2 .. 7 are ROM space
+  vector<uint32_t> physical;     // 8KB physical pages
+  bool reg_write[512] = {false}; // 0x2000 .. 0x21FF
+};
+// Call hook for accesses to the given pages and register writes, with the
+// virtual address (or physical, for DMA from ROM space). Reads report data 0
+void mmu_set_watch(WatchHandler hook, const WatchPages &pages);
+
+// Read without side effects, registers read back as last written
+uint8_t peek_mem_virtual(uint16_t addr);
+// Read ROM without watch checks, 0 if out of range
+uint8_t peek_mem_physical(uint32_t addr);
+
 // Custom read and write overrides for control registers
 // Set to nullptr if just a plain register
 extern ReadHandler reg_read_fn[256];
@@ -0,0 +1,125 @@
+#include "overlay.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace VTxx {
+
+// 3x5 pixel font, top row in the MSBs
+static const map<char, uint16_t> font = {
+    {' ', 0x0000}, {'%', 0x52A5}, {'-', 0x01C0}, {'.', 0x0002}, {'/', 0x12A4},
+    {'0', 0x7B6F}, {'1', 0x2C97}, {'2', 0x73E7}, {'3', 0x72CF}, {'4', 0x5BC9},
+    {'5', 0x79CF}, {'6', 0x79EF}, {'7', 0x7292}, {'8', 0x7BEF}, {'9', 0x7BCF},
+    {':', 0x0410}, {'=', 0x0E38}, {'A', 0x2BED}, {'B', 0x6BAE}, {'C', 0x3923},
+    {'D', 0x6B6E}, {'E', 0x79A7}, {'F', 0x79A4}, {'G', 0x396B}, {'H', 0x5BED},
+    {'I', 0x7497}, {'J', 0x126A}, {'K', 0x5BAD}, {'L', 0x4927}, {'M', 0x5FED},
+    {'N', 0x6B6D}, {'O', 0x2B6A}, {'P', 0x6BA4}, {'Q', 0x2B73}, {'R', 0x6BAD},
+    {'S', 0x388E}, {'T', 0x7492}, {'U', 0x5B6F}, {'V', 0x5B6A}, {'W', 0x5BFD},
+    {'X', 0x5AAD}, {'Y', 0x5A92}, {'Z', 0x72A7}};
+
+static const int char_w = 4, char_h = 6;
+
+static VT168_Stats last;
+static bool have_last = false;
+static chrono::steady_clock::time_point last_time;
+static vector<string> lines;
+
+template <typename T> static string fmt(T x, int prec = 0) {
+  ostringstream s;
+  s << fixed << setprecision(prec) << x;
+  return s.str();
+}
+
+void overlay_update(const VT168_Stats &st) {
+  auto now = chrono::steady_clock::now();
+  if (!have_last) {
+    last = st;
+    last_time = now;
+    have_last = true;
+    return;
+  }
+  double dt = chrono::duration<double>(now - last_time).count();
+  if (dt < 0.5 || st.frames == last.frames)
+    return;
+  double nf = double(st.frames - last.frames);
+  const PPUStats &p = st.ppu, &lp = last.ppu;
+
+  lines.clear();
+  lines.push_back("FPS " + fmt(nf / dt, 1));
+  lines.push_back("CPU INS/F " + fmt((st.cpu_instrs - last.cpu_instrs) / nf));
+  lines.push_back("SCPU INS/F " +
+                  fmt((st.scpu_instrs - last.scpu_instrs) / nf));
+  lines.push_back("DMA B/F " + fmt((st.dma_bytes - last.dma_bytes) / nf) +
+                  " STALL/F " +
+                  fmt((st.dma_stall_cycles - last.dma_stall_cycles) / nf));
+  uint64_t fetched = p.tiles_fetched - lp.tiles_fetched;
+  uint64_t hits = p.tile_cache_hits - lp.tile_cache_hits;
+  lines.push_back("TILES/F " + fmt(fetched / nf) + " HIT " +
+                  fmt(100.0 * hits / max<uint64_t>(fetched + hits, 1)) + "%");
+  lines.push_back("SPR/LN " + fmt((p.sprites_drawn - lp.sprites_drawn) /
+                                      (nf * 240), 1) +
+                  " MAX " + fmt(p.max_sprites_per_line));
+  lines.push_back("LAYERS/LN " +
+                  fmt((p.layers_merged - lp.layers_merged) / (nf * 240), 1));
+  lines.push_back("REUSED LN/F " +
+                  fmt((p.lines_reused - lp.lines_reused) / nf, 1));
+  lines.push_back("STALL MS/F " +
+                  fmt((p.render_stall_ns - lp.render_stall_ns) / (nf * 1e6),
+                      2));
+  lines.push_back("SPIN MS/F " +
+                  fmt((p.cpu_spin_ns - lp.cpu_spin_ns) / (nf * 1e6), 2));
+
+  // Busiest registers
+  vector<pair<uint64_t, int>> regs;
+  for (int i = 0; i < 512; i++) {
+    uint64_t n = (st.mmio_reads[i] - last.mmio_reads[i]) +
+                 (st.mmio_writes[i] - last.mmio_writes[i]);
+    if (n > 0)
+      regs.push_back(make_pair(n, i));
+  }
+  sort(regs.rbegin(), regs.rend());
+  for (size_t i = 0; i < regs.size() && i < 4; i++) {
+    int r = regs.at(i).second;
+    ostringstream s;
+    s << "MMIO " << hex << uppercase << (0x2000 + r) << dec << " R "
+      << fmt((st.mmio_reads[r] - last.mmio_reads[r]) / nf) << " W "
+      << fmt((st.mmio_writes[r] - last.mmio_writes[r]) / nf);
+    lines.push_back(s.str());
+  }
+
+  last = st;
+  last_time = now;
+}
+
+static void draw_char(uint32_t *buf, int stride, int x0, int y0, char c) {
+  auto g = font.find(c);
+  if (g == font.end())
+    return;
+  for (int y = 0; y < 5; y++)
+    for (int x = 0; x < 3; x++)
+      if ((g->second >> (14 - (y * 3 + x))) & 0x1)
+        buf[(y0 + y) * stride + (x0 + x)] = 0xFFFFFFFF;
+}
+
+void overlay_draw(uint32_t *buf, int width, int height, int stride) {
+  int y0 = 2;
+  for (auto &l : lines) {
+    if (y0 + char_h > height)
+      break;
+    int len = min<int>(l.size(), (width - 4) / char_w);
+    // Darken the background behind the text
+    for (int y = y0 - 1; y < y0 + char_h - 1; y++)
+      for (int x = 1; x < 3 + len * char_w; x++)
+        buf[y * stride + x] =
+            0xFF000000 | ((buf[y * stride + x] >> 2) & 0x3F3F3F);
+    for (int i = 0; i < len; i++)
+      draw_char(buf, stride, 2 + i * char_w, y0, l.at(i));
+    y0 += char_h;
+  }
+}
+
+} // namespace VTxx
@@ -0,0 +1,17 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+#include "vt168.hpp"
+#include <cstdint>
+using namespace std;
+
+namespace VTxx {
+// On-screen performance counter display
+
+// Update the displayed counters, call once per frame. Rates are averaged over
+// about half a second
+void overlay_update(const VT168_Stats &st);
+// Draw the counters over an ARGB8888 frame
+void overlay_draw(uint32_t *buf, int width, int height, int stride);
+} // namespace VTxx
+
+#endif /* end of include guard: OVERLAY_H */
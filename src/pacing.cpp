@@ -0,0 +1,80 @@
+#include "pacing.hpp"
+#include "audio.hpp"
+#include <chrono>
+#include <thread>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+namespace VTxx {
+
+// Sleep until this long before the deadline, then spin, as the scheduler can
+// wake us late
+static const int64_t spin_ns = 100000;
+// Give up on catching up if this many frames behind
+static const int max_lag_frames = 4;
+
+static int64_t now_ns() {
+#ifndef _WIN32
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+#else
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+static void sleep_until_ns(int64_t t) {
+#ifndef _WIN32
+  struct timespec ts;
+  ts.tv_sec = t / 1000000000LL;
+  ts.tv_nsec = t % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) != 0)
+    ; // interrupted by a signal
+#else
+  this_thread::sleep_for(chrono::nanoseconds(t - now_ns()));
+#endif
+}
+
+FramePacer::FramePacer(double fps) : fps(fps) { rebase(); }
+
+void FramePacer::set_rate(double new_fps) {
+  fps = new_fps;
+  rebase();
+}
+
+void FramePacer::set_speed(double multiplier) {
+  speed = multiplier;
+  rebase();
+}
+
+void FramePacer::rebase() {
+  origin_ns = now_ns();
+  frame = 0;
+}
+
+void FramePacer::wait_frame() {
+  if (fps <= 0)
+    return;
+  double period_ns = 1e9 / (fps * speed);
+  frame++;
+  int64_t deadline = origin_ns + int64_t(frame * period_ns);
+  int64_t now = now_ns();
+  if ((now - deadline) > int64_t(max_lag_frames * period_ns)) {
+    rebase();
+    return;
+  }
+  if ((deadline - now) > spin_ns)
+    sleep_until_ns(deadline - spin_ns);
+  while (now_ns() < deadline)
+    ;
+}
+
+void pace_to_audio(size_t target_frames) {
+  while (audio_queued() > target_frames)
+    sleep_until_ns(now_ns() + 1000000);
+}
+
+} // namespace VTxx
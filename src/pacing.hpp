@@ -0,0 +1,35 @@
+#ifndef PACING_H
+#define PACING_H
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+
+namespace VTxx {
+// Wall clock frame pacing. Sleeps until shortly before each frame deadline and
+// spins for the remainder. Deadlines are computed from a fixed origin so
+// rounding errors don't accumulate, and if emulation falls too far behind the
+// origin is moved rather than running fast to catch up
+class FramePacer {
+public:
+  // fps of 0 disables pacing
+  FramePacer(double fps = 0);
+  void set_rate(double fps);
+  // Fast forward multiplier, 1.0 for normal speed
+  void set_speed(double multiplier);
+  // Call once per emulated frame
+  void wait_frame();
+
+private:
+  void rebase();
+  double fps;
+  double speed = 1.0;
+  int64_t origin_ns = 0;
+  uint64_t frame = 0;
+};
+
+// Pace emulation to the audio device clock instead: wait until no more than
+// target_frames stereo frames are queued for output
+void pace_to_audio(size_t target_frames);
+} // namespace VTxx
+
+#endif /* end of include guard: PACING_H */
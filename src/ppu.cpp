@@ -1,14 +1,20 @@
 #include "ppu.hpp"
+#include "capture.hpp"
+#include "framewriter.hpp"
 #include "mmu.hpp"
+#include "threadpool.hpp"
 #include "util.hpp"
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 namespace VTxx {
 
@@ -27,13 +33,39 @@ const int layer_count = 3 * 4;
 // 0x8123 is a special colour, "dig"
 static uint32_t *layers[layer_count];
 static int layer_width, layer_height;
-
-// Output buffer in ARGB8888 format
+// Bitmask for each layer row of the layers drawn to it this frame, so that
+// clearing and merging can skip empty layers
+static uint16_t row_layers[256];
+
+// Triple buffered output in ARGB8888 format. The render thread draws into
+// obuf, which is obufs[back_buf], then exchanges it with ready_buf. The
+// consumer exchanges front_buf with ready_buf when a fresh frame is there
+static uint32_t *obufs[3];
 static uint32_t *obuf;
+static int back_buf = 0, front_buf = 1;
+static const int buf_fresh = 0x4;
+static atomic<int> ready_buf(2);
 static int out_width, out_height;
 
 static thread ppu_thread;
 
+// Render thread counters are accumulated per frame in frame_stats, then added
+// to total_stats at the end of each frame
+static PPUStats frame_stats, total_stats;
+static mutex stats_mutex;
+static uint64_t cpu_spin_ns = 0;
+
+// What the render functions read for one line: either the live registers and
+// memories, or a snapshot taken when the line began (see band rendering)
+struct LineCtx {
+  volatile uint8_t *regs;
+  volatile uint8_t *vram;
+  volatile uint8_t *spram;
+  uint8_t line_scroll;
+  uint32_t spram_gen;
+  PPUStats *stats;
+};
+
 enum class ColourMode { IDX_4, IDX_16, IDX_64, IDX_256, ARGB1555 };
 
 static int get_bpp(ColourMode fmt) {
@@ -56,12 +88,12 @@ static const int vflip = 0x02;
 static const int scale_2x = 0x03;
 static const int scale_1x5 = 0x02;
 // Our custom (slow) blitting function
-static void vt_blit(int src_width, int src_height, uint8_t *src, int dst_width,
-                    int dst_height, int dst_stride, int dst_x, int dst_y,
-                    int flip, int scale, uint32_t *dst, ColourMode fmt,
-                    int line, volatile uint8_t *pal0 = nullptr,
+static void vt_blit(int src_width, int src_height, const uint8_t *src,
+                    int dst_width, int dst_height, int dst_stride, int dst_x,
+                    int dst_y, int flip, int scale, uint32_t *dst,
+                    ColourMode fmt, int line, volatile uint8_t *pal0 = nullptr,
                     volatile uint8_t *pal1 = nullptr) {
-  uint8_t *srcptr = src;
+  const uint8_t *srcptr = src;
   int src_bit = 0;
   int sy = (line - dst_y);
   if (flip & vflip)
@@ -193,56 +225,140 @@ static void get_char_data(uint16_t seg, uint16_t vector, int w, int h,
   //  cout << "pa = 0x" << hex << pa << endl;
   int len = (w * h * bpp) / 8;
   for (int i = 0; i < len; i++)
-    buf[i] = read_mem_physical(pa + i);
+    buf[i] = peek_mem_physical(pa + i);
 }
 
-static void render_sprites(int line) {
-  // TODO: lots of rendering fixes, e.g. multi palette blending, sprite per line
-  // limit, "dig"
-  bool sp_en = get_bit(ppu_regs[reg_sp_ctrl], 2);
-  if (!sp_en)
+const int sprite_count = 240;
+// The VT168 per-line sprite limit isn't documented, so this only bounds the
+// bins. The lowest numbered sprites are kept, as they have priority
+const int sprite_line_limit = 240;
+
+struct SpriteAttrs {
+  int x, y, layer, palette, flip;
+  bool psel;
+  uint16_t vector;
+};
+
+static SpriteAttrs decode_sprite(volatile uint8_t *spdata) {
+  SpriteAttrs sp;
+  sp.vector = ((spdata[1] & 0x0F) << 8UL) | spdata[0];
+  sp.layer = (spdata[3] >> 3) & 0x03;
+  sp.palette = (spdata[1] >> 4) & 0x0F;
+  sp.psel = get_bit(spdata[5], 1);
+  sp.flip = (spdata[3] >> 1) & 0x03;
+  sp.x = unsigned(spdata[2]);
+  if (get_bit(spdata[3], 0))
+    sp.x = sp.x - 256;
+  sp.y = unsigned(spdata[4]);
+  if (get_bit(spdata[5], 0))
+    sp.y = sp.y - 256;
+  return sp;
+}
+
+// Sprites sorted into per-line lists at the start of each frame, with their
+// attributes and character data decoded once. Only valid for lines where the
+// sprite registers and SPRAM are unchanged since binning
+struct SpriteBins {
+  uint8_t ctrl, seg_lsb, seg_msb;
+  uint32_t spram_gen;
+  SpriteAttrs attrs[sprite_count];
+  uint8_t chars[sprite_count][16 * 16 / 2];
+  uint8_t count[240];
+  uint8_t index[240][sprite_line_limit];
+};
+static SpriteBins sprite_bins;
+// Incremented on every SPRAM write
+static atomic<uint32_t> spram_gen(0);
+
+static void bin_sprites(const LineCtx &c, SpriteBins &bins) {
+  bins.ctrl = c.regs[reg_sp_ctrl];
+  bins.seg_lsb = c.regs[reg_sp_seg_lsb];
+  bins.seg_msb = c.regs[reg_sp_seg_msb];
+  bins.spram_gen = c.spram_gen;
+  fill(bins.count, bins.count + 240, 0);
+  if (!get_bit(bins.ctrl, 2))
     return;
-  bool spalsel = get_bit(ppu_regs[reg_sp_ctrl], 3);
-  int sp_size = ppu_regs[reg_sp_ctrl] & 0x03;
+  int sp_size = bins.ctrl & 0x03;
   int sp_width = (sp_size == 1 || sp_size == 3) ? 16 : 8;
   int sp_height = (sp_size == 2 || sp_size == 3) ? 16 : 8;
-  uint16_t sp_seg =
-      (ppu_regs[reg_sp_seg_msb] & 0x0F) << 8 | ppu_regs[reg_sp_seg_lsb];
-
-  uint8_t tempbuf[16 * 16];
-  int spcnt = 0;
-  for (int idx = 239; idx >= 0; idx--) {
-    volatile uint8_t *spdata = spram + 8 * idx;
-    uint16_t vector = ((spdata[1] & 0x0F) << 8UL) | spdata[0];
-    if (vector == 0)
+  uint16_t sp_seg = (bins.seg_msb & 0x0F) << 8 | bins.seg_lsb;
+  for (int idx = 0; idx < sprite_count; idx++) {
+    SpriteAttrs &sp = bins.attrs[idx];
+    sp = decode_sprite(c.spram + 8 * idx);
+    if (sp.vector == 0)
       continue;
-    spcnt++;
-    int layer = (spdata[3] >> 3) & 0x03;
-    int palette = (spdata[1] >> 4) & 0x0F;
-    bool psel = get_bit(spdata[5], 1);
-    int x = unsigned(spdata[2]);
-    if (get_bit(spdata[3], 0))
-      x = x - 256;
-    int y = unsigned(spdata[4]);
-    if (get_bit(spdata[5], 0))
-      y = y - 256;
-    if ((y > line) || ((y + sp_height) < line)) {
+    int y0 = max(sp.y, 0), y1 = min(sp.y + sp_height, 240);
+    if (y0 >= y1)
       continue;
+    get_char_data(sp_seg, sp.vector, sp_width, sp_height, ColourMode::IDX_16,
+                  false, bins.chars[idx]);
+    c.stats->tiles_fetched++;
+    for (int line = y0; line < y1; line++)
+      if (bins.count[line] < sprite_line_limit)
+        bins.index[line][bins.count[line]++] = idx;
+  }
+}
+
+static void draw_sprite(const LineCtx &c, const SpriteAttrs &sp,
+                        const uint8_t *chars, int w, int h, bool spalsel,
+                        int line) {
+  volatile uint8_t *pal0 = nullptr, *pal1 = nullptr;
+  if (spalsel || !sp.psel)
+    pal0 = (c.vram + 0x1E00 + 32 * sp.palette);
+  if (spalsel || sp.psel)
+    pal1 = (c.vram + 0x1C00 + 32 * sp.palette);
+  vt_blit(w, h, chars, layer_width, layer_height, layer_width, sp.x, sp.y,
+          sp.flip, 0, layers[sp.layer * 3], ColourMode::IDX_16, line, pal0,
+          pal1);
+  row_layers[line] |= (1 << (sp.layer * 3));
+}
+
+static void render_sprites(const LineCtx &c, int line) {
+  // TODO: lots of rendering fixes, e.g. multi palette blending, "dig"
+  bool sp_en = get_bit(c.regs[reg_sp_ctrl], 2);
+  if (!sp_en)
+    return;
+  bool spalsel = get_bit(c.regs[reg_sp_ctrl], 3);
+  int sp_size = c.regs[reg_sp_ctrl] & 0x03;
+  int sp_width = (sp_size == 1 || sp_size == 3) ? 16 : 8;
+  int sp_height = (sp_size == 2 || sp_size == 3) ? 16 : 8;
+  uint16_t sp_seg =
+      (c.regs[reg_sp_seg_msb] & 0x0F) << 8 | c.regs[reg_sp_seg_lsb];
+
+  int line_sprites = 0;
+  const SpriteBins &bins = sprite_bins;
+  if (bins.ctrl == c.regs[reg_sp_ctrl] &&
+      bins.seg_lsb == c.regs[reg_sp_seg_lsb] &&
+      bins.seg_msb == c.regs[reg_sp_seg_msb] &&
+      bins.spram_gen == c.spram_gen) {
+    // Draw in reverse so lower numbered sprites end up on top
+    for (int i = bins.count[line] - 1; i >= 0; i--) {
+      int idx = bins.index[line][i];
+      draw_sprite(c, bins.attrs[idx], bins.chars[idx], sp_width, sp_height,
+                  spalsel, line);
+      line_sprites++;
+    }
+  } else {
+    // Sprites changed mid-frame, scan them all
+    uint8_t tempbuf[16 * 16];
+    for (int idx = sprite_count - 1; idx >= 0; idx--) {
+      SpriteAttrs sp = decode_sprite(c.spram + 8 * idx);
+      if (sp.vector == 0)
+        continue;
+      if ((line < sp.y) || (line >= (sp.y + sp_height)))
+        continue;
+      get_char_data(sp_seg, sp.vector, sp_width, sp_height,
+                    ColourMode::IDX_16, false, tempbuf);
+      c.stats->tiles_fetched++;
+      draw_sprite(c, sp, tempbuf, sp_width, sp_height, spalsel, line);
+      line_sprites++;
+      /*  if (get_bit(spdata[5], 2))
+          cout << "vrch" << endl;*/
     }
-    get_char_data(sp_seg, vector, sp_width, sp_height, ColourMode::IDX_16,
-                  false, tempbuf);
-    volatile uint8_t *pal0 = nullptr, *pal1 = nullptr;
-    if (spalsel || !psel)
-      pal0 = (vram + 0x1E00 + 32 * palette);
-    if (spalsel || psel)
-      pal1 = (vram + 0x1C00 + 32 * palette);
-    vt_blit(sp_width, sp_height, tempbuf, layer_width, layer_height,
-            layer_width, x, y, (spdata[3] >> 1) & 0x03, 0, layers[layer * 3],
-            ColourMode::IDX_16, line, pal0, pal1);
-    /*  if (get_bit(spdata[5], 2))
-        cout << "vrch" << endl;*/
   }
-  // cout << spcnt << endl;
+  c.stats->sprites_drawn += line_sprites;
+  c.stats->max_sprites_per_line =
+      max(c.stats->max_sprites_per_line, line_sprites);
 }
 
 const int reg_bkg_x[2] = {0x10, 0x14};
@@ -340,80 +456,107 @@ static pair<uint16_t, bool> get_tile_addr(int tx, int ty, bool y8, bool x8,
   }
 }
 
+// Colour format of a background layer
+static ColourMode bkg_format(const volatile uint8_t *regs, int idx) {
+  bool hclr = (idx == 0) ? get_bit(regs[reg_bkg_ctrl1[idx]], 4) : false;
+  if (hclr)
+    return ColourMode::ARGB1555;
+  // check, datasheet doesn't specify
+  switch ((regs[reg_bkg_ctrl2[idx]] >> 2) & 0x03) {
+  case 0:
+    return ColourMode::IDX_4;
+  case 1:
+    return ColourMode::IDX_16;
+  case 2:
+    return ColourMode::IDX_64;
+  default:
+    return ColourMode::IDX_256;
+  }
+}
+
+// Offset into the palette and depth of a background cell, given the palette
+// bank bits of its VRAM word
+static uint16_t bkg_palette_offset(const volatile uint8_t *regs, int idx,
+                                   ColourMode fmt, uint8_t cell_pal_bk,
+                                   uint8_t &depth) {
+  uint8_t ctrl2 = regs[reg_bkg_ctrl2[idx]];
+  uint16_t pal_bank = 0;
+  if (!get_bit(ctrl2, 6)) {
+    depth = (ctrl2 >> 4) & 0x03;
+    pal_bank = (fmt == ColourMode::IDX_16)
+                   ? cell_pal_bk
+                   : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
+  } else {
+    depth = cell_pal_bk & 0x03;
+    pal_bank = (fmt == ColourMode::IDX_16)
+                   ? (((ctrl2 >> 2) & 0x0C) | (cell_pal_bk >> 2))
+                   : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
+  }
+  return (fmt == ColourMode::IDX_16)
+             ? (pal_bank * 32UL)
+             : (fmt == ColourMode::IDX_64 ? (pal_bank * 128UL) : 0);
+}
+
+// Mark the layer rows that vt_blit writes to for a given line
+static void mark_layer_rows(int layer, int line, int scale) {
+  int y = scale == scale_2x ? (line * 2)
+                            : (scale == scale_1x5 ? ((line * 3) / 2) : line);
+  int extent = (scale == scale_2x) ? (y + 1) : y;
+  for (; y <= extent && y < layer_height; y++)
+    row_layers[y] |= (1 << layer);
+}
+
 // Render the given background layer (idx = [0, 1])
-static void render_background(int idx, int line) {
-  /*if (get_bit(ppu_regs[0x01], 0))
+static void render_background(const LineCtx &c, int idx, int line) {
+  /*if (get_bit(c.regs[0x01], 0))
     cout << "BK_INI" << endl;*/
-  bool en = get_bit(ppu_regs[reg_bkg_ctrl2[idx]], 7);
+  bool en = get_bit(c.regs[reg_bkg_ctrl2[idx]], 7);
   if (!en)
     return;
-  bool bkx_pal = get_bit(ppu_regs[reg_bkg_ctrl2[idx]], 6);
-  ColourMode fmt;
-  bool hclr = (idx == 0) ? get_bit(ppu_regs[reg_bkg_ctrl1[idx]], 4) : false;
-  int bkx_clr = (ppu_regs[reg_bkg_ctrl2[idx]] >> 2) & 0x03;
-  if (hclr) {
-    // cout << "HCLR" << endl;
-    fmt = ColourMode::ARGB1555;
-  } else {
-    switch (bkx_clr) { // check, datasheet doesn't specify
-    case 0:
-      fmt = ColourMode::IDX_4;
-      break;
-    case 1:
-      fmt = ColourMode::IDX_16;
-      break;
-    case 2:
-      fmt = ColourMode::IDX_64;
-      break;
-    case 3:
-      fmt = ColourMode::IDX_256;
-      break;
-    }
-  }
-  bool x8 = get_bit(ppu_regs[reg_bkg_ctrl1[idx]], 0);
-  bool y8 = get_bit(ppu_regs[reg_bkg_ctrl1[idx]], 1);
-  bool render_pal0 = get_bit(ppu_regs[reg_bkg_pal_sel], 0 + 2 * idx);
-  bool render_pal1 = get_bit(ppu_regs[reg_bkg_pal_sel], 1 + 2 * idx);
+  ColourMode fmt = bkg_format(c.regs, idx);
+  bool x8 = get_bit(c.regs[reg_bkg_ctrl1[idx]], 0);
+  bool y8 = get_bit(c.regs[reg_bkg_ctrl1[idx]], 1);
+  bool render_pal0 = get_bit(c.regs[reg_bkg_pal_sel], 0 + 2 * idx);
+  bool render_pal1 = get_bit(c.regs[reg_bkg_pal_sel], 1 + 2 * idx);
 
-  int xoff = unsigned(ppu_regs[reg_bkg_x[idx]]);
+  int xoff = unsigned(c.regs[reg_bkg_x[idx]]);
   if (x8)
     xoff = xoff - 256;
-  int yoff = unsigned(ppu_regs[reg_bkg_y[idx]]);
+  int yoff = unsigned(c.regs[reg_bkg_y[idx]]);
   if (y8)
     yoff = yoff - 256;
-  cout << "BKG" << idx << " loc " << dec << xoff << " " << yoff << endl;
+  // cout << "BKG" << idx << " loc " << dec << xoff << " " << yoff << endl;
 
-  bool bmp = (idx == 1) ? get_bit(ppu_regs[reg_bkg_ctrl2[idx]], 1) : false;
+  bool bmp = (idx == 1) ? get_bit(c.regs[reg_bkg_ctrl2[idx]], 1) : false;
   if (bmp) {
     // cout << "BMP" << endl;
   }
   BkgScrollMode scrl_mode =
-      (BkgScrollMode)((ppu_regs[reg_bkg_ctrl1[idx]] >> 2) & 0x03);
-  cout << "scrl " << (int)scrl_mode << endl;
-  bool line_scroll = get_bit(ppu_regs[reg_bkg_linescroll], 4 + idx);
-  int line_scroll_bank = ppu_regs[reg_bkg_linescroll] & 0x0F;
-  // cout << "BKG" << idx << " ls " << line_scroll << " " << line_scroll_bank
-  //     << endl;
-  bool bkx_size = get_bit(ppu_regs[reg_bkg_ctrl2[idx]], 0);
+      (BkgScrollMode)((c.regs[reg_bkg_ctrl1[idx]] >> 2) & 0x03);
+  // cout << "scrl " << (int)scrl_mode << endl;
+  bool line_scroll = get_bit(c.regs[reg_bkg_linescroll], 4 + idx);
+  bool bkx_size = get_bit(c.regs[reg_bkg_ctrl2[idx]], 0);
   int tile_height = bmp ? 1 : (bkx_size ? 16 : 8);
   int tile_width = bmp ? 256 : (bkx_size ? 16 : 8);
   int y0 = -512;
   int x0 = -512;
   int xn = 512;
   uint8_t char_buf[512];
+  // Adjacent tiles often share a vector, so keep the last one decoded
+  int last_vector = -1;
 
-  uint16_t seg = ((ppu_regs[reg_bkg_seg_msb[idx]] & 0x0F) << 8UL) |
-                 ppu_regs[reg_bkg_seg_lsb[idx]];
+  uint16_t seg = ((c.regs[reg_bkg_seg_msb[idx]] & 0x0F) << 8UL) |
+                 c.regs[reg_bkg_seg_lsb[idx]];
 
-  int scale = (ppu_regs[reg_bkg_scale] >> (2 * idx)) & 0x03;
-  // cout << "ctrl1: " << hex << (int)ppu_regs[reg_bkg_ctrl1[idx]] <<
-  // endl;  cout << "ctrl2: " << hex << (int)ppu_regs[reg_bkg_ctrl2[idx]]
+  int scale = (c.regs[reg_bkg_scale] >> (2 * idx)) & 0x03;
+  // cout << "ctrl1: " << hex << (int)c.regs[reg_bkg_ctrl1[idx]] <<
+  // endl;  cout << "ctrl2: " << hex << (int)c.regs[reg_bkg_ctrl2[idx]]
   // << endl;
 
   int y = line - yoff;
 
   if (line_scroll) {
-    uint8_t ls = cpu_ram[(line_scroll_bank << 8) | (line & 0xFF)];
+    uint8_t ls = c.line_scroll;
     if (get_bit(ls, 7)) {
       xoff += (ls & 0x7F) - 128;
     } else {
@@ -435,40 +578,33 @@ static void render_background(int idx, int line) {
     bool tile_mapped = tile_d.second;
     if (!tile_mapped)
       continue;
-    uint16_t cell = (vram[tile_addr + 1] << 8UL) | vram[tile_addr];
+    uint16_t cell = (c.vram[tile_addr + 1] << 8UL) | c.vram[tile_addr];
     uint16_t vector = cell & 0xFFF;
     uint8_t cell_pal_bk = (cell >> 12) & 0x0F;
     if (vector == 0) // transparent
       continue;
-    uint16_t pal_bank = 0;
     uint8_t depth = 0;
-    if (!bkx_pal) {
-      depth = (ppu_regs[reg_bkg_ctrl2[idx]] >> 4) & 0x03;
-      pal_bank = (fmt == ColourMode::IDX_16)
-                     ? cell_pal_bk
-                     : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
+    uint16_t palette_offset =
+        bkg_palette_offset(c.regs, idx, fmt, cell_pal_bk, depth);
+
+    if (vector != last_vector) {
+      get_char_data(seg, vector, tile_width, tile_height, fmt, bmp, char_buf);
+      last_vector = vector;
+      c.stats->tiles_fetched++;
     } else {
-      depth = cell_pal_bk & 0x03;
-      pal_bank = (fmt == ColourMode::IDX_16)
-                     ? (((ppu_regs[reg_bkg_ctrl2[idx]] >> 2) & 0x0C) |
-                        (cell_pal_bk >> 2))
-                     : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
+      c.stats->tile_cache_hits++;
     }
-
-    get_char_data(seg, vector, tile_width, tile_height, fmt, bmp, char_buf);
     // TODO: line scrolling
-    uint16_t palette_offset =
-        (fmt == ColourMode::IDX_16)
-            ? (pal_bank * 32UL)
-            : (fmt == ColourMode::IDX_64 ? (pal_bank * 128UL) : 0);
     volatile uint8_t *pal0 = nullptr, *pal1 = nullptr;
     if (render_pal0)
-      pal0 = (vram + 0x1E00 + palette_offset);
+      pal0 = (c.vram + 0x1E00 + palette_offset);
     if (render_pal1)
-      pal1 = (vram + 0x1C00 + palette_offset);
+      pal1 = (c.vram + 0x1C00 + palette_offset);
+    int layer = (depth & 0x03) * 3 + (1 + idx);
     vt_blit(tile_width, tile_height, char_buf, layer_width, layer_height,
-            layer_width, lx, ly, 0, scale,
-            layers[(depth & 0x03) * 3 + (1 + idx)], fmt, line, pal0, pal1);
+            layer_width, lx, ly, 0, scale, layers[layer], fmt, line, pal0,
+            pal1);
+    mark_layer_rows(layer, line, scale);
   }
 }
 
@@ -508,14 +644,20 @@ static inline uint32_t argb1555_to_rgb8888(uint16_t x) {
 
 // Merge the layers and convert to ARGB8888. Set lcd to true to merge for LCD
 // rather than TV output
-static void merge_layers(int y, bool lcd = false) {
-  bool output_pal0 = get_bit(ppu_regs[reg_pal_sel], lcd ? 0 : 1);
-  bool output_pal1 = get_bit(ppu_regs[reg_pal_sel], lcd ? 2 : 3);
-  bool blend_pal = get_bit(ppu_regs[reg_pal_sel], lcd ? 5 : 4);
+static void merge_layers(const LineCtx &c, int y, bool lcd = false) {
+  bool output_pal0 = get_bit(c.regs[reg_pal_sel], lcd ? 0 : 1);
+  bool output_pal1 = get_bit(c.regs[reg_pal_sel], lcd ? 2 : 3);
+  bool blend_pal = get_bit(c.regs[reg_pal_sel], lcd ? 5 : 4);
+  uint16_t mask = row_layers[y];
+  for (int l = 0; l < layer_count; l++)
+    if (get_bit(mask, l))
+      c.stats->layers_merged++;
   for (int x = 0; x < out_width; x++) {
     uint16_t pal0 = 0x8000, pal1 = 0x8000;
     int pal0_layer = layer_count, pal1_layer = layer_count;
     for (int l = layer_count - 1; l >= 0; l--) {
+      if (!get_bit(mask, l))
+        continue;
       uint32_t raw = layers[l][y * layer_width + x];
       if (!(raw & 0x8000)) {
         pal0 = raw & 0xFFFF;
@@ -553,9 +695,120 @@ static void clear_layer(uint32_t *ptr, int w, int h) {
   fill(ptr, ptr + (w * h), 0x80008000); // fill with transparent
 }
 
-static void clear_layers() {
-  for (int i = 0; i < layer_count - 1; i++)
-    clear_layer(layers[i], layer_width, layer_height);
+// Clear the layer rows in [y0, y1) that were drawn to in the last frame
+static void clear_layers(int y0, int y1) {
+  for (int y = y0; y < y1; y++) {
+    for (int i = 0; i < layer_count; i++)
+      if (get_bit(row_layers[y], i))
+        clear_layer(layers[i] + y * layer_width, layer_width, 1);
+    row_layers[y] = 0;
+  }
+}
+
+// Damage tracking: the output of a line depends only on the registers, its
+// line scroll byte, the VRAM cells and palettes it reads, the sprites on it and
+// character data in ROM. A hash of these is kept for each line, and lines whose
+// hash is unchanged copy the previous frame's output rather than being
+// rendered. Scaled backgrounds draw to the rows of later lines, so lines from
+// the first scaled one on are always rendered
+static atomic<bool> line_reuse(true);
+static uint64_t line_keys[240];
+static bool line_key_valid[240];
+// Output buffer holding the last frame rendered, or -1
+static int last_buf = -1;
+// Bumped on every palette write, so palettes are only rehashed when written
+static atomic<uint32_t> pal_gen(1);
+static uint32_t pal_hash_gen = 0;
+static uint64_t pal_hash = 0;
+// Frame contents version per output buffer, see ppu_get_frame_version
+static uint32_t frame_version = 0;
+static atomic<uint32_t> buf_versions[3];
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t x) {
+  h = (h ^ x) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 32);
+}
+
+static uint64_t palette_hash(const volatile uint8_t *v) {
+  uint64_t h = 0;
+  for (int i = 0x1C00; i < 0x2000; i += 4)
+    h = hash_mix(h, v[i] | (v[i + 1] << 8) | (v[i + 2] << 16) |
+                        (uint32_t(v[i + 3]) << 24));
+  return h;
+}
+
+// Hash the tilemap cells a background reads for a line, following the same
+// walk as render_background
+static uint64_t bkg_line_key(const LineCtx &c, int idx, int line, uint64_t h) {
+  if (!get_bit(c.regs[reg_bkg_ctrl2[idx]], 7))
+    return h;
+  bool x8 = get_bit(c.regs[reg_bkg_ctrl1[idx]], 0);
+  bool y8 = get_bit(c.regs[reg_bkg_ctrl1[idx]], 1);
+  int yoff = unsigned(c.regs[reg_bkg_y[idx]]);
+  if (y8)
+    yoff = yoff - 256;
+  bool bmp = (idx == 1) ? get_bit(c.regs[reg_bkg_ctrl2[idx]], 1) : false;
+  BkgScrollMode scrl_mode =
+      (BkgScrollMode)((c.regs[reg_bkg_ctrl1[idx]] >> 2) & 0x03);
+  bool bkx_size = get_bit(c.regs[reg_bkg_ctrl2[idx]], 0);
+  int tile_height = bmp ? 1 : (bkx_size ? 16 : 8);
+  int tile_width = bmp ? 256 : (bkx_size ? 16 : 8);
+  int ty = (line - yoff + 512) / tile_height;
+  for (int tx = 0; tx < 1024 / tile_width; tx++) {
+    auto tile_d =
+        get_tile_addr(tx, ty, y8, x8, tile_width, bmp, idx, scrl_mode);
+    if (tile_d.second)
+      h = hash_mix(h, (c.vram[tile_d.first + 1] << 8) | c.vram[tile_d.first]);
+  }
+  return h;
+}
+
+// Returns false if the line can't be keyed, when sprites changed since they
+// were binned
+static bool line_key(const LineCtx &c, int line, uint64_t &key) {
+  uint64_t h = hash_mix(pal_hash, rom_write_gen);
+  for (int r = reg_pal_sel; r <= reg_bkg_linescroll; r++)
+    h = hash_mix(h, c.regs[r]);
+  h = hash_mix(h, c.line_scroll);
+  h = bkg_line_key(c, 0, line, h);
+  h = bkg_line_key(c, 1, line, h);
+  if (get_bit(c.regs[reg_sp_ctrl], 2)) {
+    const SpriteBins &bins = sprite_bins;
+    if (bins.ctrl != c.regs[reg_sp_ctrl] ||
+        bins.seg_lsb != c.regs[reg_sp_seg_lsb] ||
+        bins.seg_msb != c.regs[reg_sp_seg_msb] ||
+        bins.spram_gen != c.spram_gen)
+      return false;
+    for (int i = 0; i < bins.count[line]; i++) {
+      int idx = bins.index[line][i];
+      volatile uint8_t *sp = c.spram + 8 * idx;
+      h = hash_mix(h, idx);
+      h = hash_mix(h, sp[0] | (sp[1] << 8) | (sp[2] << 16) |
+                          (uint32_t(sp[3]) << 24));
+      h = hash_mix(h, sp[4] | (sp[5] << 8));
+    }
+  }
+  key = h;
+  return true;
+}
+
+// Update the key for a line, returning true if its previous output can be
+// reused. If allow is false the line is rendered and not keyed
+static bool line_unchanged(const LineCtx &c, int line, bool allow) {
+  uint64_t key = 0;
+  bool keyed = allow && line_key(c, line, key);
+  bool same = keyed && last_buf >= 0 && line_key_valid[line] &&
+              line_keys[line] == key;
+  line_keys[line] = key;
+  line_key_valid[line] = keyed;
+  if (same)
+    c.stats->lines_reused++;
+  return same;
+}
+
+static void reuse_line(int y) {
+  const uint32_t *src = obufs[last_buf] + y * out_width;
+  copy(src, src + out_width, obuf + y * out_width);
 }
 
 static atomic<bool> render_done(false);
@@ -568,28 +821,202 @@ static uint32_t h_total = 341;
 static atomic<uint32_t> ticks(0);
 static atomic<int> render_line(0);
 
+static RenderPolicy render_policy = RenderPolicy::FULL;
+static int render_every = 1;
+static uint32_t policy_frames = 0;
+static atomic<bool> render_requested(false);
+// Whether the current and the last frame are rendered, decided as each frame
+// starts
+static bool render_frame = true, last_frame_rendered = true;
+// Total host time spent in do_render, for benchmarking
+static atomic<uint64_t> render_ns(0);
+
+// Band rendering: the registers and line scroll byte are captured as each
+// visible line begins. At the end of the visible area these are copied along
+// with VRAM and SPRAM, and the render thread renders the frame in bands on a
+// thread pool while the CPU carries on. This replaces racing the beam, so only
+// register and line scroll changes are seen mid-frame
+struct LineSnapshot {
+  uint8_t regs[256];
+  uint8_t line_scroll;
+};
+static LineSnapshot line_snaps[240], band_snaps[240];
+static uint8_t band_vram[8192], band_spram[2048];
+static ThreadPool *render_pool = nullptr;
+static atomic<bool> band_busy(false);
+// More bands than threads so that uneven bands balance out
+static const int bands_per_thread = 4;
+
+static uint8_t get_line_scroll(volatile uint8_t *regs, int line) {
+  return cpu_ram[((regs[reg_bkg_linescroll] & 0x0F) << 8) | (line & 0xFF)];
+}
+
+static LineCtx live_ctx(int line) {
+  LineCtx c;
+  c.regs = ppu_regs;
+  c.vram = vram;
+  c.spram = spram;
+  c.line_scroll = get_line_scroll(ppu_regs, line);
+  c.spram_gen = spram_gen;
+  c.stats = &frame_stats;
+  return c;
+}
+
+static LineCtx band_ctx(int line, PPUStats *stats) {
+  LineCtx c;
+  c.regs = band_snaps[line].regs;
+  c.vram = band_vram;
+  c.spram = band_spram;
+  c.line_scroll = band_snaps[line].line_scroll;
+  // The SPRAM snapshot doesn't change during the frame
+  c.spram_gen = 0;
+  c.stats = stats;
+  return c;
+}
+
+void ppu_set_ntsc(bool ntsc) {
+  if (ntsc) {
+    vblank_len = 20 * h_total;
+    v_total = 262 * h_total;
+  } else {
+    vblank_len = 64 * h_total;
+    v_total = 312 * h_total;
+  }
+}
+
+uint32_t ppu_get_frame_ticks() { return v_total; }
+
 bool ppu_is_hbegin() { return ticks % h_total == 0; }
 int ppu_get_vcnt() { return ticks / h_total; }
-// Render and merge all layers
-static void do_render() {
-  render_done = false;
 
+// Render each line just behind the beam
+static void render_lines() {
   // Fill all layers with transparent
-  clear_layers();
+  clear_layers(0, layer_height);
+  bin_sprites(live_ctx(0), sprite_bins);
+  bool allow_reuse = line_reuse;
   for (int line = 0; line < 240; line++) {
     render_line = line;
-
+    LineCtx c = live_ctx(line);
+
+    if (c.regs[reg_bkg_scale] != 0)
+      allow_reuse = false;
+    if (allow_reuse) {
+      uint32_t gen = pal_gen;
+      if (gen != pal_hash_gen) {
+        pal_hash = palette_hash(vram);
+        pal_hash_gen = gen;
+      }
+    }
+    bool reuse = line_unchanged(c, line, allow_reuse);
     // cout << dec << line << endl;
     // Render background layers (higher index has priority)
-    render_background(0, line);
-    render_background(1, line);
-    // Render sprites
-    render_sprites(line);
-    while (ticks < (vblank_start + (h_total * line)))
-      ;
-    merge_layers(line, false);
+    if (!reuse) {
+      render_background(c, 0, line);
+      render_background(c, 1, line);
+      // Render sprites
+      render_sprites(c, line);
+    }
+    if (ticks < (vblank_start + (h_total * line))) {
+      auto wait_start = chrono::steady_clock::now();
+      while (ticks < (vblank_start + (h_total * line)))
+        ;
+      frame_stats.render_stall_ns +=
+          chrono::duration_cast<chrono::nanoseconds>(
+              chrono::steady_clock::now() - wait_start)
+              .count();
+    }
+    if (reuse)
+      reuse_line(line);
+    else
+      merge_layers(c, line, false);
+  }
+}
+
+// Render a captured frame in bands. Each pass must finish before the next, as
+// merging a row needs every line that draws to it
+static void render_bands() {
+  int bands = render_pool->size() * bands_per_thread;
+  vector<PPUStats> band_stats(bands);
+  render_pool->run(bands, [&](int b) {
+    clear_layers((b * layer_height) / bands, ((b + 1) * layer_height) / bands);
+  });
+  // Scaled backgrounds draw to rows of other lines, so bands would race on the
+  // row masks
+  bool scaled = false;
+  for (int line = 0; line < 240; line++)
+    if (band_snaps[line].regs[reg_bkg_scale] != 0)
+      scaled = true;
+  bin_sprites(band_ctx(0, &frame_stats), sprite_bins);
+  bool allow_reuse = line_reuse && !scaled;
+  if (allow_reuse)
+    pal_hash = palette_hash(band_vram);
+  bool reuse[240];
+  int draw_bands = scaled ? 1 : bands;
+  render_pool->run(draw_bands, [&](int b) {
+    for (int line = (b * 240) / draw_bands;
+         line < ((b + 1) * 240) / draw_bands; line++) {
+      LineCtx c = band_ctx(line, &band_stats[b]);
+      reuse[line] = line_unchanged(c, line, allow_reuse);
+      if (reuse[line])
+        continue;
+      render_background(c, 0, line);
+      render_background(c, 1, line);
+      render_sprites(c, line);
+    }
+  });
+  render_pool->run(bands, [&](int b) {
+    for (int line = (b * 240) / bands; line < ((b + 1) * 240) / bands;
+         line++) {
+      if (reuse[line])
+        reuse_line(line);
+      else
+        merge_layers(band_ctx(line, &band_stats[b]), line, false);
+    }
+  });
+  for (auto &st : band_stats) {
+    frame_stats.tiles_fetched += st.tiles_fetched;
+    frame_stats.tile_cache_hits += st.tile_cache_hits;
+    frame_stats.sprites_drawn += st.sprites_drawn;
+    frame_stats.max_sprites_per_line =
+        max(frame_stats.max_sprites_per_line, st.max_sprites_per_line);
+    frame_stats.layers_merged += st.layers_merged;
+    frame_stats.lines_reused += st.lines_reused;
   }
+}
+
+// Render and merge all layers
+static void do_render() {
+  render_done = false;
+  auto start = chrono::steady_clock::now();
+  obuf = obufs[back_buf];
+
+  if (render_pool != nullptr)
+    render_bands();
+  else
+    render_lines();
   render_line = 300;
+  if (frame_stats.lines_reused < 240 || last_buf < 0)
+    frame_version++;
+  buf_versions[back_buf] = frame_version;
+  last_buf = back_buf;
+  {
+    lock_guard<mutex> lk(stats_mutex);
+    total_stats.tiles_fetched += frame_stats.tiles_fetched;
+    total_stats.tile_cache_hits += frame_stats.tile_cache_hits;
+    total_stats.sprites_drawn += frame_stats.sprites_drawn;
+    total_stats.max_sprites_per_line = frame_stats.max_sprites_per_line;
+    total_stats.layers_merged += frame_stats.layers_merged;
+    total_stats.render_stall_ns += frame_stats.render_stall_ns;
+    total_stats.lines_reused += frame_stats.lines_reused;
+    total_stats.frames_rendered++;
+    frame_stats = PPUStats();
+  }
+  capture_frame(obuf);
+  back_buf = ready_buf.exchange(back_buf | buf_fresh) & 0x3;
+  render_ns += chrono::duration_cast<chrono::nanoseconds>(
+                   chrono::steady_clock::now() - start)
+                   .count();
   // Merge to output
   render_done = true;
 };
@@ -607,27 +1034,80 @@ void ppu_render_thread() {
     // Signal might be to die rather than render again
     if (!kill_renderer) {
       do_render();
+      band_busy = false;
     }
     lk.unlock();
   }
 }
 
+static void start_render() {
+  {
+    lock_guard<mutex> lk(do_render_m);
+    render_ready = true;
+  }
+  do_render_cv.notify_one();
+}
+
+// Capture state at the start of a line for band rendering, and start the
+// render at the end of the visible area
+static void band_line_begin(int line) {
+  if (line < 240) {
+    LineSnapshot &snap = line_snaps[line];
+    copy(ppu_regs, ppu_regs + 256, snap.regs);
+    snap.line_scroll = get_line_scroll(ppu_regs, line);
+  } else if (line == 240) {
+    if (band_busy) {
+      auto spin_start = chrono::steady_clock::now();
+      while (band_busy)
+        continue;
+      cpu_spin_ns += chrono::duration_cast<chrono::nanoseconds>(
+                         chrono::steady_clock::now() - spin_start)
+                         .count();
+    }
+    copy(line_snaps, line_snaps + 240, band_snaps);
+    copy(vram, vram + 8192, band_vram);
+    copy(spram, spram + 2048, band_spram);
+    band_busy = true;
+    start_render();
+  }
+}
+
+static bool want_frame() {
+  switch (render_policy) {
+  case RenderPolicy::FULL:
+    return true;
+  case RenderPolicy::EVERY_N:
+    return (policy_frames++ % render_every) == 0;
+  case RenderPolicy::ON_DEMAND:
+    return render_requested.exchange(false);
+  default:
+    return false;
+  }
+}
+
 // Called once every CPU clock
 void ppu_tick() {
   ticks += 1;
   if (ticks >= v_total) {
     ticks = 0;
+    last_frame_rendered = render_frame;
+    render_frame = want_frame();
     // TODO: signal vblank NMI
+  } else if (!render_frame) {
+    // Skipped frame, nothing to capture or wait for
+  } else if (render_pool != nullptr) {
+    if (ticks >= vblank_len && ((ticks - vblank_len) % h_total) == 0)
+      band_line_begin((ticks - vblank_len) / h_total);
   } else if (ticks >= (((render_line + 1) * h_total) + vblank_len)) {
+    auto spin_start = chrono::steady_clock::now();
     while ((ticks >= (((render_line + 1) * h_total) + vblank_len)))
       continue;
+    cpu_spin_ns += chrono::duration_cast<chrono::nanoseconds>(
+                       chrono::steady_clock::now() - spin_start)
+                       .count();
   } else if (ticks == vblank_len) {
     // Render begins at end of VBLANK
-    {
-      lock_guard<mutex> lk(do_render_m);
-      render_ready = true;
-    }
-    do_render_cv.notify_one();
+    start_render();
   }
 } // namespace VTxx
 
@@ -635,7 +1115,51 @@ bool ppu_is_render_done() { return render_done; }
 
 bool ppu_is_vblank() { return (ticks >= vblank_start && ticks < vblank_len); }
 
-uint32_t *get_render_buffer() { return obuf; }
+bool ppu_acquire_frame() {
+  if (!(ready_buf & buf_fresh))
+    return false;
+  front_buf = ready_buf.exchange(front_buf) & 0x3;
+  return true;
+}
+
+uint32_t *get_render_buffer() { return obufs[front_buf]; }
+
+uint32_t ppu_get_frame_version() { return buf_versions[front_buf]; }
+
+void ppu_set_line_reuse(bool enabled) { line_reuse = enabled; }
+
+void ppu_set_render_policy(RenderPolicy policy, int n) {
+  render_policy = policy;
+  render_every = max(n, 1);
+  policy_frames = 0;
+  // Render one frame to start with, as the consumer requests the next after
+  // showing one
+  if (policy == RenderPolicy::ON_DEMAND)
+    render_requested = true;
+  if (ticks == 0)
+    render_frame = want_frame();
+}
+
+void ppu_request_frame() { render_requested = true; }
+
+bool ppu_frame_rendered() { return last_frame_rendered; }
+
+void ppu_set_render_threads(int n) {
+  if (n > 1)
+    render_pool = new ThreadPool(n);
+}
+
+uint64_t ppu_get_render_ns() { return render_ns; }
+
+PPUStats ppu_get_stats() {
+  PPUStats st;
+  {
+    lock_guard<mutex> lk(stats_mutex);
+    st = total_stats;
+  }
+  st.cpu_spin_ns = cpu_spin_ns;
+  return st;
+}
 
 void ppu_init() {
   layer_width = 256;
@@ -644,10 +1168,13 @@ void ppu_init() {
     ppu_regs[i] = 0;
   for (int i = 0; i < layer_count; i++) {
     layers[i] = new uint32_t[layer_width * layer_height];
+    clear_layer(layers[i], layer_width, layer_height);
   }
   out_width = 256;
   out_height = 240;
-  obuf = new uint32_t[out_width * out_height];
+  for (int i = 0; i < 3; i++)
+    obufs[i] = new uint32_t[out_width * out_height]();
+  obuf = obufs[back_buf];
   ppu_thread = thread(ppu_render_thread);
 }
 
@@ -659,6 +1186,8 @@ void ppu_stop() {
   }
   do_render_cv.notify_one();
   ppu_thread.join();
+  delete render_pool;
+  render_pool = nullptr;
 }
 
 const uint8_t reg_ppu_stat = 0x01;
@@ -701,6 +1230,7 @@ void ppu_write(uint8_t address, uint8_t data) {
     uint16_t spram_addr = (ppu_regs[reg_spram_addr_lsb] & 0x07) |
                           (ppu_regs[reg_spram_addr_msb] << 3);
     spram[spram_addr++] = data;
+    spram_gen++;
     if ((spram_addr & 0x07) >= 6) { // TODO: check, is this just for DMA?
       spram_addr &= ~0x07;
       spram_addr += 8;
@@ -713,6 +1243,8 @@ void ppu_write(uint8_t address, uint8_t data) {
     uint16_t vram_addr = ((ppu_regs[reg_vram_addr_msb] & 0x1F) << 8) |
                          ppu_regs[reg_vram_addr_lsb];
     // cout << "vram wr " << hex << vram_addr << " d=" << int(data) << endl;
+    if (vram_addr >= 0x1C00)
+      pal_gen++;
     vram[vram_addr++] = data;
     ppu_regs[reg_vram_addr_msb] = (vram_addr >> 8) & 0x1F;
     ppu_regs[reg_vram_addr_lsb] = vram_addr & 0xFF;
@@ -731,56 +1263,51 @@ void ppu_write(uint8_t address, uint8_t data) {
   }
 }
 
-static void write_bmp(string filename, int width, int height, uint32_t *data) {
-  ofstream out(filename);
-  int rowsize = (3 * width);
-  rowsize = ((rowsize + 3) / 4) * 4;
-  uint8_t header[54];
-  fill(header, header + 54, 0x0);
-  header[0] = 0x42;
-  header[1] = 0x4D;
-  int imagesize = 54 + height * rowsize;
-  header[2] = (imagesize & 0xFF);
-  header[3] = ((imagesize >> 8) & 0xFF);
-  header[4] = ((imagesize >> 16) & 0xFF);
-  header[5] = ((imagesize >> 24) & 0xFF);
-  header[10] = 54;
-  header[14] = 40;
-  header[18] = (width & 0xFF);
-  header[19] = ((width >> 8) & 0xFF);
-  header[20] = ((width >> 16) & 0xFF);
-  header[21] = ((width >> 24) & 0xFF);
-  header[22] = (height & 0xFF);
-  header[23] = ((height >> 8) & 0xFF);
-  header[24] = ((height >> 16) & 0xFF);
-  header[25] = ((height >> 24) & 0xFF);
-  header[26] = 1;
-  header[27] = 0;
-  header[28] = 24;
-  header[38] = 0xD7;
-  header[39] = 0xD;
-  header[42] = 0xD7;
-  header[43] = 0xD;
-  header[49] = 0x1;
-  header[53] = 0x1;
-  out.write((const char *)header, 54);
-  uint8_t *linebuf = new uint8_t[rowsize];
-  uint8_t *lptr = linebuf;
-  for (int y = height - 1; y >= 0; y--) {
-    lptr = linebuf;
-    for (int x = 0; x < width; x++) {
-      uint32_t argb = data[y * width + x];
-      *(lptr++) = (argb)&0xFF;
-      *(lptr++) = (argb >> 8) & 0xFF;
-      *(lptr++) = (argb >> 16) & 0xFF;
+void ppu_dma_write(uint8_t port, const uint8_t *src, int len) {
+  lock_guard<std::mutex> guard(regs_mutex);
+  if (port == reg_spram_data) {
+    uint16_t spram_addr = (ppu_regs[reg_spram_addr_lsb] & 0x07) |
+                          (ppu_regs[reg_spram_addr_msb] << 3);
+    // Copy in runs up to the bytes that are skipped at the end of each entry
+    while (len > 0) {
+      int pos = spram_addr & 0x07;
+      int run = min(len, (pos < 6) ? (6 - pos) : 1);
+      memcpy((uint8_t *)spram + (spram_addr & 0x7FF), src, run);
+      src += run;
+      len -= run;
+      spram_addr += run;
+      if ((spram_addr & 0x07) >= 6) {
+        spram_addr &= ~0x07;
+        spram_addr += 8;
+      }
     }
-    out.write((const char *)linebuf, rowsize);
+    spram_gen++;
+    ppu_regs[reg_spram_addr_msb] = (spram_addr >> 3) & 0xFF;
+    ppu_regs[reg_spram_addr_lsb] = spram_addr & 0x07;
+  } else if (port == reg_vram_data) {
+    uint16_t vram_addr = ((ppu_regs[reg_vram_addr_msb] & 0x1F) << 8) |
+                         ppu_regs[reg_vram_addr_lsb];
+    while (len > 0) {
+      int run = min(len, 0x2000 - vram_addr);
+      if (vram_addr + run > 0x1C00)
+        pal_gen++;
+      memcpy((uint8_t *)vram + vram_addr, src, run);
+      src += run;
+      len -= run;
+      vram_addr = (vram_addr + run) & 0x1FFF;
+    }
+    ppu_regs[reg_vram_addr_msb] = (vram_addr >> 8) & 0x1F;
+    ppu_regs[reg_vram_addr_lsb] = vram_addr & 0xFF;
+  } else {
+    assert(false);
   }
-  delete[] linebuf;
 }
 
-void ppu_write_screenshot(string filename) {
-  write_bmp(filename, out_width, out_height, obuf);
+static void write_bmp(string filename, int width, int height, uint32_t *data) {
+  vector<uint8_t> bmp;
+  frame_encode(FrameFormat::BMP, data, width, height, bmp);
+  ofstream out(filename, ios::binary);
+  out.write((const char *)bmp.data(), bmp.size());
 }
 
 void ppu_dump_tilemaps(string basename) {
@@ -789,29 +1316,7 @@ void ppu_dump_tilemaps(string basename) {
     bool en = get_bit(ppu_regs[reg_bkg_ctrl2[idx]], 7);
     if (!en)
       continue;
-    bool bkx_pal = get_bit(ppu_regs[reg_bkg_ctrl2[idx]], 6);
-    ColourMode fmt;
-    bool hclr = (idx == 0) ? get_bit(ppu_regs[reg_bkg_ctrl1[idx]], 4) : false;
-    int bkx_clr = (ppu_regs[reg_bkg_ctrl2[idx]] >> 2) & 0x03;
-    if (hclr) {
-      // cout << "HCLR" << endl;
-      fmt = ColourMode::ARGB1555;
-    } else {
-      switch (bkx_clr) { // check, datasheet doesn't specify
-      case 0:
-        fmt = ColourMode::IDX_4;
-        break;
-      case 1:
-        fmt = ColourMode::IDX_16;
-        break;
-      case 2:
-        fmt = ColourMode::IDX_64;
-        break;
-      case 3:
-        fmt = ColourMode::IDX_256;
-        break;
-      }
-    }
+    ColourMode fmt = bkg_format(ppu_regs, idx);
 
     bool render_pal0 = get_bit(ppu_regs[reg_bkg_pal_sel], 0 + 2 * idx);
     bool render_pal1 = get_bit(ppu_regs[reg_bkg_pal_sel], 1 + 2 * idx);
@@ -839,29 +1344,12 @@ void ppu_dump_tilemaps(string basename) {
         uint8_t cell_pal_bk = (cell >> 12) & 0x0F;
         if (vector == 0) // transparent
           continue;
-        uint16_t pal_bank = 0;
         uint8_t depth = 0;
-        if (!bkx_pal) {
-          depth = (ppu_regs[reg_bkg_ctrl2[idx]] >> 4) & 0x03;
-          pal_bank =
-              (fmt == ColourMode::IDX_16)
-                  ? cell_pal_bk
-                  : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
-        } else {
-          depth = cell_pal_bk & 0x03;
-          pal_bank =
-              (fmt == ColourMode::IDX_16)
-                  ? (((ppu_regs[reg_bkg_ctrl2[idx]] >> 2) & 0x0C) |
-                     (cell_pal_bk >> 2))
-                  : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
-        }
+        uint16_t palette_offset =
+            bkg_palette_offset(ppu_regs, idx, fmt, cell_pal_bk, depth);
 
         get_char_data(seg, vector, tile_width, tile_height, fmt, bmp, char_buf);
         // TODO: line scrolling
-        uint16_t palette_offset =
-            (fmt == ColourMode::IDX_16)
-                ? (pal_bank * 32UL)
-                : (fmt == ColourMode::IDX_64 ? (pal_bank * 128UL) : 0);
         volatile uint8_t *pal0 = nullptr, *pal1 = nullptr;
         if (render_pal0)
           pal0 = (vram + 0x1E00 + palette_offset);
@@ -888,6 +1376,289 @@ void ppu_dump_tilemaps(string basename) {
   }
 }
 
+// Debug views. Each cell of a view remembers the memory words it was last
+// drawn from, so only changed cells are redrawn
+struct ViewState {
+  vector<uint32_t> image;
+  vector<uint64_t> cells;
+  uint64_t key = 0;
+  bool valid = false;
+};
+static ViewState views[ppu_view_count];
+static const int view_dims[ppu_view_count][2] = {
+    {512, 512}, {512, 512}, {288, 270}, {264, 128}, {256, 256}};
+static uint8_t snap_regs[256], snap_vram[8192], snap_spram[2048];
+static uint8_t last_palettes[0x400];
+// Bumped when either palette bank changes between snapshots
+static uint32_t palette_gen = 0;
+static PPUTileBrowse tile_browse;
+static const uint32_t view_backdrop = 0xFF404040;
+static const uint32_t view_transparent = 0xFFFF00FF;
+
+void ppu_view_size(PPUView v, int &width, int &height) {
+  width = view_dims[int(v)][0];
+  height = view_dims[int(v)][1];
+}
+
+void ppu_view_snapshot() {
+  lock_guard<std::mutex> guard(regs_mutex);
+  copy(ppu_regs, ppu_regs + 256, snap_regs);
+  copy(vram, vram + 8192, snap_vram);
+  copy(spram, spram + 2048, snap_spram);
+  if (!equal(snap_vram + 0x1C00, snap_vram + 0x2000, last_palettes)) {
+    copy(snap_vram + 0x1C00, snap_vram + 0x2000, last_palettes);
+    palette_gen++;
+  }
+}
+
+void ppu_view_invalidate(PPUView v) { views[int(v)].valid = false; }
+
+void ppu_view_set_tiles(const PPUTileBrowse &browse) { tile_browse = browse; }
+
+static uint64_t view_key(initializer_list<uint32_t> values) {
+  uint64_t h = 14695981039346656037ULL;
+  for (uint32_t v : values)
+    h = (h ^ v) * 1099511628211ULL;
+  return h;
+}
+
+static void grow_rect(PPUViewRect &r, int x, int y, int w, int h) {
+  if (r.w == 0) {
+    r.x = x;
+    r.y = y;
+    r.w = w;
+    r.h = h;
+    return;
+  }
+  int x1 = max(r.x + r.w, x + w), y1 = max(r.y + r.h, y + h);
+  r.x = min(r.x, x);
+  r.y = min(r.y, y);
+  r.w = x1 - r.x;
+  r.h = y1 - r.y;
+}
+
+static void view_fill(ViewState &v, int width, int x, int y, int w, int h,
+                      uint32_t colour) {
+  for (int j = y; j < (y + h); j++)
+    fill(v.image.begin() + (j * width + x),
+         v.image.begin() + (j * width + x + w), colour);
+}
+
+// Draw a character at (x, y), showing its pal0 output unless only pal1 is used
+static void view_draw_char(ViewState &v, int width, int x, int y, int w,
+                           int h, const uint8_t *chars, ColourMode fmt,
+                           uint8_t *pal0, uint8_t *pal1) {
+  uint32_t buf[256];
+  fill(buf, buf + (w * h), 0x80008000);
+  for (int line = 0; line < h; line++)
+    vt_blit(w, h, chars, w, h, w, 0, 0, 0, 0, buf, fmt, line, pal0, pal1);
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++) {
+      uint32_t raw = buf[j * w + i];
+      v.image[(y + j) * width + x + i] = argb1555_to_rgb8888(
+          (pal0 == nullptr) ? ((raw >> 16) & 0xFFFF) : (raw & 0xFFFF));
+    }
+  }
+}
+
+// The whole 512x512 plane of a background, as mapped by get_tile_addr
+static void view_draw_bkg(ViewState &v, int idx, PPUViewRect &dirty) {
+  const int width = 512, height = 512;
+  uint8_t ctrl1 = snap_regs[reg_bkg_ctrl1[idx]];
+  uint8_t ctrl2 = snap_regs[reg_bkg_ctrl2[idx]];
+  uint16_t seg = ((snap_regs[reg_bkg_seg_msb[idx]] & 0x0F) << 8UL) |
+                 snap_regs[reg_bkg_seg_lsb[idx]];
+  bool bmp = (idx == 1) ? get_bit(ctrl2, 1) : false;
+  int tile_width = bmp ? 256 : (get_bit(ctrl2, 0) ? 16 : 8);
+  int tile_height = bmp ? 1 : tile_width;
+  int cols = width / tile_width, rows = height / tile_height;
+  BkgScrollMode scrl_mode = (BkgScrollMode)((ctrl1 >> 2) & 0x03);
+  // 4 page scrolling isn't supported for 8x8 tiles
+  bool en = get_bit(ctrl2, 7) && !(tile_width == 8 && scrl_mode == SCROLL_4P);
+  uint64_t key = view_key({ctrl1, ctrl2, seg, snap_regs[reg_bkg_pal_sel],
+                           palette_gen});
+  if (!v.valid || key != v.key) {
+    v.valid = true;
+    v.key = key;
+    v.cells.assign(cols * rows, UINT64_MAX);
+    view_fill(v, width, 0, 0, width, height,
+              en ? view_transparent : view_backdrop);
+    grow_rect(dirty, 0, 0, width, height);
+  }
+  if (!en)
+    return;
+  ColourMode fmt = bkg_format(snap_regs, idx);
+  bool x8 = get_bit(ctrl1, 0), y8 = get_bit(ctrl1, 1);
+  bool render_pal0 = get_bit(snap_regs[reg_bkg_pal_sel], 0 + 2 * idx);
+  bool render_pal1 = get_bit(snap_regs[reg_bkg_pal_sel], 1 + 2 * idx);
+  uint8_t char_buf[512];
+  for (int ty = 0; ty < rows; ty++) {
+    for (int tx = 0; tx < cols; tx++) {
+      uint16_t addr = get_tile_addr(tx, ty, y8, x8, tile_width, bmp,
+                                    bmp ? 0 : idx, scrl_mode)
+                          .first;
+      uint16_t cell = (snap_vram[addr + 1] << 8UL) | snap_vram[addr];
+      uint64_t &last = v.cells[ty * cols + tx];
+      if (last == cell)
+        continue;
+      last = cell;
+      int x = tx * tile_width, y = ty * tile_height;
+      uint16_t vector = cell & 0xFFF;
+      if (vector == 0) {
+        view_fill(v, width, x, y, tile_width, tile_height, view_transparent);
+      } else {
+        uint8_t depth = 0;
+        uint16_t palette_offset =
+            bkg_palette_offset(snap_regs, idx, fmt, cell >> 12, depth);
+        get_char_data(seg, vector, tile_width, tile_height, fmt, bmp,
+                      char_buf);
+        view_draw_char(
+            v, width, x, y, tile_width, tile_height, char_buf, fmt,
+            render_pal0 ? (snap_vram + 0x1E00 + palette_offset) : nullptr,
+            render_pal1 ? (snap_vram + 0x1C00 + palette_offset) : nullptr);
+      }
+      grow_rect(dirty, x, y, tile_width, tile_height);
+    }
+  }
+}
+
+// All sprites in a 16x15 grid of 18 pixel cells
+static void view_draw_sprites(ViewState &v, PPUViewRect &dirty) {
+  const int width = 288, height = 270, cell_size = 18;
+  uint8_t ctrl = snap_regs[reg_sp_ctrl];
+  uint16_t seg =
+      (snap_regs[reg_sp_seg_msb] & 0x0F) << 8 | snap_regs[reg_sp_seg_lsb];
+  uint64_t key = view_key({ctrl & 0x0BU, seg, palette_gen});
+  if (!v.valid || key != v.key) {
+    v.valid = true;
+    v.key = key;
+    v.cells.assign(sprite_count, UINT64_MAX);
+    view_fill(v, width, 0, 0, width, height, view_backdrop);
+    grow_rect(dirty, 0, 0, width, height);
+  }
+  int sp_size = ctrl & 0x03;
+  int sp_width = (sp_size == 1 || sp_size == 3) ? 16 : 8;
+  int sp_height = (sp_size == 2 || sp_size == 3) ? 16 : 8;
+  bool spalsel = get_bit(ctrl, 3);
+  uint8_t char_buf[16 * 16 / 2];
+  for (int idx = 0; idx < sprite_count; idx++) {
+    uint8_t *entry = snap_spram + 8 * idx;
+    uint64_t word = 0;
+    for (int i = 0; i < 6; i++)
+      word |= uint64_t(entry[i]) << (8 * i);
+    if (v.cells[idx] == word)
+      continue;
+    v.cells[idx] = word;
+    int x = (idx % 16) * cell_size + 1, y = (idx / 16) * cell_size + 1;
+    view_fill(v, width, x, y, 16, 16, view_transparent);
+    SpriteAttrs sp = decode_sprite(entry);
+    if (sp.vector != 0) {
+      get_char_data(seg, sp.vector, sp_width, sp_height, ColourMode::IDX_16,
+                    false, char_buf);
+      uint8_t *pal0 = nullptr, *pal1 = nullptr;
+      if (spalsel || !sp.psel)
+        pal0 = snap_vram + 0x1E00 + 32 * sp.palette;
+      if (spalsel || sp.psel)
+        pal1 = snap_vram + 0x1C00 + 32 * sp.palette;
+      view_draw_char(v, width, x, y, sp_width, sp_height, char_buf,
+                     ColourMode::IDX_16, pal0, pal1);
+    }
+    grow_rect(dirty, x, y, 16, 16);
+  }
+}
+
+// The palettes at 0x1C00 and 0x1E00 side by side, as 16x16 grids of swatches
+static void view_draw_palettes(ViewState &v, PPUViewRect &dirty) {
+  const int width = 264, height = 128;
+  if (!v.valid) {
+    v.valid = true;
+    v.cells.assign(512, UINT64_MAX);
+    view_fill(v, width, 0, 0, width, height, view_backdrop);
+    grow_rect(dirty, 0, 0, width, height);
+  }
+  for (int i = 0; i < 512; i++) {
+    uint8_t *entry = snap_vram + 0x1C00 + 2 * i;
+    uint16_t colour = (entry[1] << 8) | entry[0];
+    if (v.cells[i] == colour)
+      continue;
+    v.cells[i] = colour;
+    int x = (i / 256) * 136 + (i % 16) * 8, y = ((i % 256) / 16) * 8;
+    // Bit 15 is dig, not transparent
+    view_fill(v, width, x, y, 8, 8, argb1555_to_rgb8888(colour & 0x7FFF));
+    grow_rect(dirty, x, y, 8, 8);
+  }
+}
+
+// ROM characters from the start of a segment, in the browser's format
+static void view_draw_tiles(ViewState &v, PPUViewRect &dirty) {
+  const int width = 256;
+  const PPUTileBrowse &b = tile_browse;
+  uint64_t key = view_key({b.seg, uint32_t(b.bpp), uint32_t(b.size),
+                           uint32_t(b.palette), b.pal1, palette_gen});
+  if (v.valid && key == v.key)
+    return;
+  v.valid = true;
+  v.key = key;
+  ColourMode fmt;
+  switch (b.bpp) {
+  case 2:
+    fmt = ColourMode::IDX_4;
+    break;
+  case 6:
+    fmt = ColourMode::IDX_64;
+    break;
+  case 8:
+    fmt = ColourMode::IDX_256;
+    break;
+  case 16:
+    fmt = ColourMode::ARGB1555;
+    break;
+  default:
+    fmt = ColourMode::IDX_16;
+    break;
+  }
+  uint16_t palette_offset =
+      (fmt == ColourMode::IDX_16)
+          ? ((b.palette & 0x0F) * 32)
+          : (fmt == ColourMode::IDX_64 ? ((b.palette & 0x03) * 128) : 0);
+  uint8_t *pal = snap_vram + (b.pal1 ? 0x1C00 : 0x1E00) + palette_offset;
+  int cols = width / b.size;
+  uint8_t char_buf[512];
+  for (int i = 0; i < cols * cols; i++) {
+    get_char_data(b.seg, i, b.size, b.size, fmt, false, char_buf);
+    view_draw_char(v, width, (i % cols) * b.size, (i / cols) * b.size, b.size,
+                   b.size, char_buf, fmt, b.pal1 ? nullptr : pal,
+                   b.pal1 ? pal : nullptr);
+  }
+  grow_rect(dirty, 0, 0, width, width);
+}
+
+const uint32_t *ppu_view_draw(PPUView v, PPUViewRect &dirty) {
+  ViewState &vs = views[int(v)];
+  int width, height;
+  ppu_view_size(v, width, height);
+  vs.image.resize(width * height);
+  dirty = PPUViewRect();
+  switch (v) {
+  case PPUView::BKG0:
+    view_draw_bkg(vs, 0, dirty);
+    break;
+  case PPUView::BKG1:
+    view_draw_bkg(vs, 1, dirty);
+    break;
+  case PPUView::SPRITES:
+    view_draw_sprites(vs, dirty);
+    break;
+  case PPUView::PALETTES:
+    view_draw_palettes(vs, dirty);
+    break;
+  case PPUView::TILES:
+    view_draw_tiles(vs, dirty);
+    break;
+  }
+  return vs.image.data();
+}
+
 bool ppu_nmi_enabled() { return get_bit(ppu_regs[0], 0); }
 
 void ppu_reset() {
@@ -895,8 +1666,10 @@ void ppu_reset() {
     ppu_regs[i] = 0;
   for (int i = 0; i < 2048; i++)
     spram[i] = 0;
+  spram_gen++;
   for (int i = 0; i < 8192; i++)
     vram[i] = 0;
+  pal_gen++;
 }
 
 } // namespace VTxx
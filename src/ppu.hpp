@@ -10,6 +10,10 @@ namespace VTxx {
 // implementation
 
 void ppu_init();
+// Select NTSC (262 line) or PAL (312 line) frame timing, PAL by default
+void ppu_set_ntsc(bool ntsc);
+// PPU ticks per frame
+uint32_t ppu_get_frame_ticks();
 void ppu_stop();
 void ppu_reset();
 // Call once every four clocks (i.e. once every cpu tick)
@@ -18,6 +22,9 @@ void ppu_tick();
 // Write/Read PPU address space, address is 0..255 relative to 0x2000
 void ppu_write(uint8_t addr, uint8_t data);
 uint8_t ppu_read(uint8_t addr);
+// Write a block to the SPRAM or VRAM data port (0x04 or 0x07), as if written
+// byte by byte, including address auto-increment
+void ppu_dma_write(uint8_t port, const uint8_t *src, int len);
 
 bool ppu_is_render_done();
 bool ppu_is_vblank();
@@ -25,11 +32,91 @@ bool ppu_is_hbegin();
 int ppu_get_vcnt();
 bool ppu_nmi_enabled();
 
-// Return the PPU output as a 256x240 ARGB buffer
+// Make the most recently completed frame the render buffer, returning false
+// if there hasn't been a new frame since the last call. Only one thread may
+// consume frames
+bool ppu_acquire_frame();
+// Return the PPU output as a 256x240 ARGB buffer. This is the frame taken by
+// ppu_acquire_frame, and doesn't change until the next call
 uint32_t *get_render_buffer();
+// Version of the frame taken by ppu_acquire_frame. It only changes when a frame
+// differs from the one rendered before it, so consumers can skip presenting or
+// encoding frames with the version they last handled
+uint32_t ppu_get_frame_version();
+
+// Which frames to render. Skipped frames aren't rendered or merged at all
+// (the render thread isn't woken), but timing, NMI and status reads are
+// unaffected and the last rendered frame stays available
+enum class RenderPolicy {
+  FULL,      // every frame
+  EVERY_N,   // one frame in every n
+  ON_DEMAND, // the next frame to start after each ppu_request_frame
+  OFF
+};
+// Takes effect from the next frame, or the first if emulation hasn't started.
+// Setting ON_DEMAND requests one frame. Call before emulation starts or from
+// the emulation thread
+void ppu_set_render_policy(RenderPolicy policy, int n = 1);
+// Render the next frame under RenderPolicy::ON_DEMAND. Any thread may call this
+void ppu_request_frame();
+// True if the frame that ended at the last vblank is being rendered, so a fresh
+// frame will follow
+bool ppu_frame_rendered();
+// Render each frame in horizontal bands on n threads once the CPU has passed
+// the visible area, rather than on one thread racing the beam. Faster for
+// batch runs, but only register and line scroll changes take effect mid-frame.
+// Call after ppu_init and before emulation starts
+void ppu_set_render_threads(int n);
+// Copy the previous output for lines whose inputs (registers, VRAM cells,
+// palettes, sprites and ROM) are unchanged, rather than rendering them. On by
+// default
+void ppu_set_line_reuse(bool enabled);
+// Total host time spent by the render thread, in nanoseconds
+uint64_t ppu_get_render_ns();
+
+struct PPUStats {
+  uint64_t tiles_fetched = 0;
+  uint64_t tile_cache_hits = 0;
+  uint64_t sprites_drawn = 0;
+  int max_sprites_per_line = 0; // in the last frame
+  uint64_t layers_merged = 0;   // non-empty layers merged, summed over lines
+  uint64_t lines_reused = 0;    // unchanged lines copied from the last frame
+  uint64_t frames_rendered = 0;
+  uint64_t render_stall_ns = 0; // render thread waiting for the beam
+  uint64_t cpu_spin_ns = 0;     // CPU thread waiting for the render thread
+};
+PPUStats ppu_get_stats();
 
-void ppu_write_screenshot(string filename);
 void ppu_dump_tilemaps(string basename);
+
+// Live views of the background maps, sprite table, palettes and ROM tiles as
+// ARGB8888 images, for the debug windows. Views are drawn from a snapshot of
+// PPU memory, and only cells whose VRAM or SPRAM words changed since they were
+// last drawn are redrawn, unless a register or palette they depend on changed.
+// ROM is assumed not to change. Use from one thread only
+enum class PPUView { BKG0, BKG1, SPRITES, PALETTES, TILES };
+const int ppu_view_count = 5;
+struct PPUViewRect {
+  int x = 0, y = 0, w = 0, h = 0;
+};
+// ROM tile browser settings
+struct PPUTileBrowse {
+  uint16_t seg = 0;  // 8KB ROM segment of the first tile
+  int bpp = 4;       // 2, 4, 6, 8 or 16
+  int size = 8;      // 8 or 16 pixels square
+  int palette = 0;   // palette bank, for 4 and 6 bpp
+  bool pal1 = false; // use the palettes at 0x1C00 rather than 0x1E00
+};
+
+void ppu_view_size(PPUView v, int &width, int &height);
+// Copy PPU memory for the views, once per frame before drawing them
+void ppu_view_snapshot();
+// Bring a view up to date with the last snapshot, returning its image and the
+// area redrawn (empty if nothing changed)
+const uint32_t *ppu_view_draw(PPUView v, PPUViewRect &dirty);
+// Redraw the whole view on the next ppu_view_draw
+void ppu_view_invalidate(PPUView v);
+void ppu_view_set_tiles(const PPUTileBrowse &browse);
 } // namespace VTxx
 
 #endif /* end of include guard: PPU_H */
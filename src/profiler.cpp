@@ -0,0 +1,169 @@
+#include "profiler.hpp"
+#include "mmu.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+namespace VTxx {
+
+bool prof_enabled = false;
+
+// Host time is sampled once every sample_period instructions
+static const int sample_period = 1024;
+static const int max_depth = 64;
+
+struct ProfEntry {
+  uint16_t va = 0;
+  uint64_t instrs = 0;
+  uint64_t host_ns = 0;
+};
+
+// Code in RAM is keyed by virtual address with ram_key set, as it has no
+// physical ROM address
+static const uint32_t ram_key = 0x80000000;
+
+static unordered_map<uint32_t, ProfEntry> flat;
+static map<string, uint64_t> folded;
+static vector<pair<uint16_t, uint32_t>> call_stack;
+static bool cpu_scramble = false;
+static int sample_count = 0;
+static uint64_t total_instrs = 0;
+static chrono::steady_clock::time_point last_sample;
+
+static uint32_t get_key(uint16_t va) {
+  if (va < 0x4000)
+    return ram_key | va;
+  return decode_address(va);
+}
+
+// Read code without going through the MMIO handlers
+static uint8_t peek(uint16_t va) {
+  if (va < 0x2000)
+    return cpu_ram[va];
+  else if (va >= 0x4000)
+    return peek_mem_physical(decode_address(va));
+  else
+    return 0x00;
+}
+
+static string loc_name(uint16_t va, uint32_t key) {
+  ostringstream s;
+  if (key & ram_key)
+    s << "ram_" << hex << setw(4) << setfill('0') << va;
+  else
+    s << "b" << hex << setw(3) << setfill('0') << (key >> 13) << "_"
+      << setw(4) << va;
+  return s.str();
+}
+
+void prof_start(bool scramble) {
+  flat.clear();
+  folded.clear();
+  call_stack.clear();
+  cpu_scramble = scramble;
+  sample_count = 0;
+  total_instrs = 0;
+  last_sample = chrono::steady_clock::now();
+  prof_enabled = true;
+}
+
+void prof_record(uint16_t pc) {
+  uint32_t key = get_key(pc);
+  ProfEntry &e = flat[key];
+  e.va = pc;
+  e.instrs++;
+  total_instrs++;
+
+  if (++sample_count == sample_period) {
+    sample_count = 0;
+    auto now = chrono::steady_clock::now();
+    uint64_t ns =
+        chrono::duration_cast<chrono::nanoseconds>(now - last_sample).count();
+    last_sample = now;
+    e.host_ns += ns;
+    string stack = "all";
+    for (auto &f : call_stack)
+      stack += ";" + loc_name(f.first, f.second);
+    folded[stack + ";" + loc_name(pc, key)] += ns;
+  }
+
+  uint8_t opcode = peek(pc);
+  if (cpu_scramble) {
+    int b2 = (opcode & 0x04) >> 2;
+    int b7 = (opcode & 0x80) >> 7;
+    opcode = (opcode & 0x7B) | (b2 << 7) | (b7 << 2);
+  }
+  if (opcode == 0x20) { // JSR
+    uint16_t target = peek(pc + 1) | (peek(pc + 2) << 8);
+    if (call_stack.size() < max_depth)
+      call_stack.push_back(make_pair(target, get_key(target)));
+  } else if (opcode == 0x60) { // RTS
+    if (!call_stack.empty())
+      call_stack.pop_back();
+  }
+}
+
+void prof_stop(const string &basename) {
+  prof_enabled = false;
+
+  vector<pair<uint32_t, ProfEntry>> entries(flat.begin(), flat.end());
+  sort(entries.begin(), entries.end(),
+       [](const pair<uint32_t, ProfEntry> &a,
+          const pair<uint32_t, ProfEntry> &b) {
+         if (a.second.host_ns != b.second.host_ns)
+           return a.second.host_ns > b.second.host_ns;
+         return a.second.instrs > b.second.instrs;
+       });
+  uint64_t total_ns = 0;
+  map<uint32_t, pair<uint64_t, uint64_t>> banks;
+  for (auto &e : entries) {
+    total_ns += e.second.host_ns;
+    uint32_t bank = (e.first & ram_key) ? 0xFFFFFFFF : (e.first >> 13);
+    banks[bank].first += e.second.instrs;
+    banks[bank].second += e.second.host_ns;
+  }
+
+  ofstream flat_out(basename + ".prof.txt");
+  flat_out << "# " << dec << total_instrs << " instructions, "
+           << (total_ns / 1000000) << " ms sampled host time" << endl;
+  flat_out << "# per bank: bank instrs instr% host_us time%" << endl;
+  for (auto &b : banks) {
+    if (b.first == 0xFFFFFFFF)
+      flat_out << "   ram";
+    else
+      flat_out << "  " << hex << setw(4) << setfill('0') << b.first;
+    flat_out << dec << setfill(' ') << setw(12) << b.second.first << setw(8)
+             << fixed << setprecision(2)
+             << (100.0 * b.second.first / max<uint64_t>(total_instrs, 1))
+             << setw(12) << (b.second.second / 1000) << setw(8)
+             << (100.0 * b.second.second / max<uint64_t>(total_ns, 1)) << endl;
+  }
+  flat_out << "# per PC: location phys instrs instr% host_us time%" << endl;
+  for (auto &e : entries) {
+    flat_out << setw(12) << loc_name(e.second.va, e.first) << "  " << hex
+             << setw(8) << setfill('0')
+             << ((e.first & ram_key) ? e.second.va : e.first) << dec
+             << setfill(' ') << setw(12) << e.second.instrs << setw(8)
+             << (100.0 * e.second.instrs / max<uint64_t>(total_instrs, 1))
+             << setw(12) << (e.second.host_ns / 1000) << setw(8)
+             << (100.0 * e.second.host_ns / max<uint64_t>(total_ns, 1))
+             << endl;
+  }
+
+  // Folded stacks are weighted in microseconds of host time
+  ofstream folded_out(basename + ".folded");
+  for (auto &f : folded)
+    if (f.second >= 1000)
+      folded_out << f.first << " " << (f.second / 1000) << endl;
+
+  cout << "Wrote profile to " << basename << ".prof.txt and " << basename
+       << ".folded" << endl;
+}
+
+} // namespace VTxx
@@ -0,0 +1,27 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+#include <cstdint>
+#include <string>
+using namespace std;
+
+namespace VTxx {
+// Guest code profiler. Counts instructions per physical PC and periodically
+// samples host time, attributing it to the current PC and a shadow call stack
+// built from JSR/RTS
+extern bool prof_enabled;
+
+void prof_start(bool scramble);
+// Stop profiling and write basename.prof.txt (flat profile) and
+// basename.folded (folded stacks for flamegraph tools)
+void prof_stop(const string &basename);
+
+void prof_record(uint16_t pc);
+
+// Call before each main CPU instruction
+inline void prof_instr(uint16_t pc) {
+  if (prof_enabled)
+    prof_record(pc);
+}
+} // namespace VTxx
+
+#endif /* end of include guard: PROFILER_H */
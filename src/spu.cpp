@@ -0,0 +1,69 @@
+#include "spu.hpp"
+#include "audio.hpp"
+#include "capture.hpp"
+#include <cassert>
+
+namespace VTxx {
+
+SPU::SPU(double master_hz, int out_rate, ResampleMode mode)
+    : mixer(master_hz / native_div, out_rate, 2, mode) {
+  set_output(1.0f, mode);
+}
+
+void SPU::set_output(float volume, ResampleMode mode) {
+  mixer.set_channel(0, volume, -1.0f);
+  mixer.set_channel(1, volume, 1.0f);
+  mixer.set_mode(mode);
+}
+
+void SPU::write(uint8_t addr, uint8_t data) {
+  assert(addr <= 3);
+  integrate();
+  dac_regs[addr] = data;
+}
+
+uint8_t SPU::read(uint8_t addr) {
+  assert(addr <= 3);
+  return dac_regs[addr];
+}
+
+// Accumulate the current levels up to now
+void SPU::integrate() {
+  for (int c = 0; c < 2; c++) {
+    int16_t level = int16_t((dac_regs[2 * c + 1] << 8) | dac_regs[2 * c]);
+    acc[c] += int64_t(level) * (phase - last_change);
+  }
+  last_change = phase;
+}
+
+void SPU::native_sample() {
+  integrate();
+  block[0][block_pos] = float(acc[0]) / native_div;
+  block[1][block_pos] = float(acc[1]) / native_div;
+  acc[0] = acc[1] = 0;
+  phase = last_change = 0;
+  if (++block_pos == block_len)
+    mix_block();
+}
+
+void SPU::mix_block() {
+  const float *in[2] = {block[0], block[1]};
+  mixer.process(in, block_pos, out);
+  block_pos = 0;
+}
+
+void SPU::flush() {
+  mix_block();
+  audio_push(out.data(), int(out.size() / 2));
+  capture_audio(out.data(), int(out.size() / 2));
+  out.clear();
+}
+
+void SPU::reset() {
+  for (int i = 0; i < 4; i++)
+    dac_regs[i] = 0;
+  acc[0] = acc[1] = 0;
+  phase = last_change = 0;
+}
+
+} // namespace VTxx
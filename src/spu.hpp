@@ -0,0 +1,50 @@
+#ifndef SPU_H
+#define SPU_H
+#include "mixer.hpp"
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+// VT168 sound. There is no synthesis hardware: the sound CPU mixes in software
+// and writes 16-bit samples to a left and a right DAC. The DAC levels are
+// averaged over each native sample period, then mixed and resampled to the
+// output rate in blocks and sent to the audio sink
+class SPU {
+public:
+  SPU(double master_hz, int out_rate, ResampleMode mode);
+  // Set the output volume (1.0 is unity) and resampler
+  void set_output(float volume, ResampleMode mode);
+  // Address is 0..3, relative to 0x2118
+  void write(uint8_t addr, uint8_t data);
+  uint8_t read(uint8_t addr);
+  // Call once per master clock
+  inline void tick() {
+    if (++phase == native_div)
+      native_sample();
+  }
+  // Send the output so far to the audio sink
+  void flush();
+  void reset();
+
+private:
+  // Master clocks per native sample
+  static const int native_div = 256;
+  // Native samples per mixer block
+  static const int block_len = 256;
+  void integrate();
+  void native_sample();
+  void mix_block();
+  uint8_t dac_regs[4] = {0};
+  int phase = 0;       // master clocks into the current native sample
+  int last_change = 0; // phase when the DAC levels were last integrated
+  int64_t acc[2] = {0, 0};
+  // Native samples for each DAC
+  float block[2][block_len];
+  int block_pos = 0;
+  Mixer mixer;
+  vector<int16_t> out;
+};
+} // namespace VTxx
+
+#endif /* end of include guard: SPU_H */
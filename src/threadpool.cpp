@@ -0,0 +1,64 @@
+#include "threadpool.hpp"
+
+namespace VTxx {
+
+ThreadPool::ThreadPool(int n) : next_idx(0) {
+  for (int i = 1; i < n; i++)
+    workers.push_back(thread(&ThreadPool::worker, this));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lk(m);
+    quit = true;
+  }
+  start_cv.notify_all();
+  for (auto &t : workers)
+    t.join();
+}
+
+void ThreadPool::do_jobs(const function<void(int)> &fn, int count) {
+  int i;
+  while ((i = next_idx.fetch_add(1)) < count)
+    fn(i);
+}
+
+void ThreadPool::worker() {
+  uint64_t seen = 0;
+  while (true) {
+    const function<void(int)> *fn;
+    int count;
+    {
+      unique_lock<mutex> lk(m);
+      start_cv.wait(lk, [&] { return quit || generation != seen; });
+      if (quit)
+        return;
+      seen = generation;
+      fn = job;
+      count = job_count;
+    }
+    do_jobs(*fn, count);
+    {
+      lock_guard<mutex> lk(m);
+      if (--active == 0)
+        done_cv.notify_one();
+    }
+  }
+}
+
+void ThreadPool::run(int count, const function<void(int)> &fn) {
+  {
+    lock_guard<mutex> lk(m);
+    job = &fn;
+    job_count = count;
+    next_idx = 0;
+    active = int(workers.size());
+    generation++;
+  }
+  start_cv.notify_all();
+  do_jobs(fn, count);
+  unique_lock<mutex> lk(m);
+  done_cv.wait(lk, [&] { return active == 0; });
+}
+
+} // namespace VTxx
@@ -0,0 +1,39 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+// Simple fork-join pool. The thread calling run takes part in the work, so a
+// pool of size n has n - 1 worker threads
+class ThreadPool {
+public:
+  ThreadPool(int n);
+  ~ThreadPool();
+  int size() const { return int(workers.size()) + 1; }
+  // Call fn(i) for each i in [0, count), returning once all calls are done.
+  // Indices are handed out dynamically so uneven jobs still balance
+  void run(int count, const function<void(int)> &fn);
+
+private:
+  void worker();
+  void do_jobs(const function<void(int)> &fn, int count);
+  vector<thread> workers;
+  mutex m;
+  condition_variable start_cv, done_cv;
+  const function<void(int)> *job = nullptr;
+  int job_count = 0;
+  atomic<int> next_idx;
+  int active = 0;
+  uint64_t generation = 0;
+  bool quit = false;
+};
+} // namespace VTxx
+
+#endif /* end of include guard: THREADPOOL_H */
@@ -22,6 +22,7 @@ void Timer::write(uint8_t addr, uint8_t data) {
     case 0x1:
       count = preload;
       config = data;
+      last_vblank = ppu_is_vblank();
       break;
     case 0x2:
       cb(false);
@@ -49,6 +50,7 @@ void Timer::write(uint8_t addr, uint8_t data) {
     case 0x2:
       count = preload;
       config = data;
+      last_vblank = ppu_is_vblank();
       break;
     case 0x3:
       cb(false);
@@ -14,6 +14,8 @@ public:
   void write(uint8_t addr, uint8_t data);
   uint8_t read(uint8_t addr);
   void tick();
+  // False while the config disables counting, when tick has no effect
+  bool is_active() const { return config & 0x01; }
 
 private:
   TimerType type;
@@ -0,0 +1,260 @@
+#include "trace.hpp"
+#include "6502/mos6502.hpp"
+#include "mmu.hpp"
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace VTxx {
+
+bool trace_armed = false;
+
+// Records are encoded into fixed size chunks. Full chunks are queued for the
+// writer thread, and the encoder waits for a free one if all are queued, so
+// the trace is never lossy
+static const size_t chunk_size = 256 * 1024;
+static const int chunk_count = 32;
+static const size_t max_record = 32;
+
+struct TraceChunk {
+  vector<uint8_t> data;
+  size_t len = 0;
+  uint32_t records = 0;
+};
+
+static vector<TraceChunk> chunks;
+static deque<int> free_chunks, full_chunks;
+static mutex chunk_mutex;
+static condition_variable free_cv, full_cv;
+static thread writer;
+static bool writer_quit = false;
+static FILE *trace_file = nullptr;
+
+static TraceCond start_cond, stop_cond;
+static bool recording = false;
+static int cur = -1;
+static uint64_t total_records = 0, total_bytes = 0;
+
+// Previous record in the current chunk
+static mos6502::mos6502::State prev;
+static uint64_t prev_cycle = 0;
+static uint32_t prev_bank = 0;
+
+static void reset_prev() {
+  prev = mos6502::mos6502::State();
+  prev_cycle = 0;
+  prev_bank = 0;
+}
+
+static void writer_fn() {
+  while (true) {
+    int idx;
+    {
+      unique_lock<mutex> lk(chunk_mutex);
+      full_cv.wait(lk, [] { return !full_chunks.empty() || writer_quit; });
+      if (full_chunks.empty())
+        return;
+      idx = full_chunks.front();
+      full_chunks.pop_front();
+    }
+    TraceChunk &c = chunks[idx];
+    uint8_t hdr[8];
+    for (int i = 0; i < 4; i++) {
+      hdr[i] = (c.len >> (8 * i)) & 0xFF;
+      hdr[4 + i] = (c.records >> (8 * i)) & 0xFF;
+    }
+    fwrite(hdr, 1, 8, trace_file);
+    fwrite(c.data.data(), 1, c.len, trace_file);
+    {
+      lock_guard<mutex> lk(chunk_mutex);
+      free_chunks.push_back(idx);
+    }
+    free_cv.notify_one();
+  }
+}
+
+static void take_chunk() {
+  unique_lock<mutex> lk(chunk_mutex);
+  free_cv.wait(lk, [] { return !free_chunks.empty(); });
+  cur = free_chunks.front();
+  free_chunks.pop_front();
+  chunks[cur].len = 0;
+  chunks[cur].records = 0;
+  reset_prev();
+}
+
+static void submit_chunk() {
+  if (cur < 0)
+    return;
+  total_bytes += chunks[cur].len + 8;
+  {
+    lock_guard<mutex> lk(chunk_mutex);
+    full_chunks.push_back(cur);
+  }
+  full_cv.notify_one();
+  cur = -1;
+}
+
+static inline void put_varint(uint8_t *&p, uint64_t v) {
+  while (v >= 0x80) {
+    *(p++) = uint8_t(v) | 0x80;
+    v >>= 7;
+  }
+  *(p++) = uint8_t(v);
+}
+
+bool trace_parse_cond(const string &s, TraceCond &c) {
+  size_t colon = s.find(':');
+  if (colon == string::npos)
+    return false;
+  string kind = s.substr(0, colon), val = s.substr(colon + 1);
+  try {
+    if (kind == "pc") {
+      c.kind = TraceTrigger::PC;
+      c.value = stoul(val, nullptr, 16);
+    } else if (kind == "frame") {
+      c.kind = TraceTrigger::FRAME;
+      c.value = stoul(val);
+    } else if (kind == "write") {
+      c.kind = TraceTrigger::WRITE;
+      c.value = stoul(val, nullptr, 16);
+    } else {
+      return false;
+    }
+  } catch (exception &e) {
+    return false;
+  }
+  return true;
+}
+
+bool trace_open(const string &file, TraceCond start, TraceCond stop) {
+  trace_file = fopen(file.c_str(), "wb");
+  if (trace_file == nullptr) {
+    cerr << "Failed to open trace file " << file << endl;
+    return false;
+  }
+  fwrite(trace_magic, 1, sizeof(trace_magic), trace_file);
+  chunks.resize(chunk_count);
+  free_chunks.clear();
+  full_chunks.clear();
+  for (int i = 0; i < chunk_count; i++) {
+    chunks[i].data.resize(chunk_size);
+    free_chunks.push_back(i);
+  }
+  writer_quit = false;
+  writer = thread(writer_fn);
+  start_cond = start;
+  stop_cond = stop;
+  recording = (start.kind == TraceTrigger::NONE);
+  total_records = total_bytes = 0;
+  trace_armed = true;
+  return true;
+}
+
+static void stop_recording() {
+  submit_chunk();
+  recording = false;
+  trace_armed = false;
+}
+
+void trace_close() {
+  if (trace_file == nullptr)
+    return;
+  stop_recording();
+  {
+    lock_guard<mutex> lk(chunk_mutex);
+    writer_quit = true;
+  }
+  full_cv.notify_one();
+  writer.join();
+  fclose(trace_file);
+  trace_file = nullptr;
+  cout << "Traced " << total_records << " instructions, " << total_bytes
+       << " bytes" << endl;
+}
+
+void trace_event(TraceTrigger kind, uint32_t value) {
+  if (!recording && start_cond.kind == kind && start_cond.value == value)
+    recording = true;
+  else if (recording && stop_cond.kind == kind && stop_cond.value == value)
+    stop_recording();
+}
+
+void trace_record(mos6502::mos6502 *cpu, uint64_t cycle) {
+  mos6502::mos6502::State s = cpu->GetState();
+  bool stop_after = false;
+  if (!recording) {
+    if (start_cond.kind != TraceTrigger::PC || start_cond.value != s.pc)
+      return;
+    recording = true;
+  } else if (stop_cond.kind == TraceTrigger::PC && stop_cond.value == s.pc) {
+    stop_after = true;
+  }
+
+  if (cur < 0)
+    take_chunk();
+  TraceChunk &c = chunks[cur];
+  uint32_t bank = 0;
+  uint8_t opcode;
+  if (s.pc >= 0x4000) {
+    uint32_t pa = decode_address(s.pc);
+    bank = pa >> 13;
+    opcode = peek_mem_physical(pa);
+  } else {
+    opcode = cpu_ram[s.pc & 0x1FFF];
+  }
+
+  uint8_t flags = 0;
+  if (s.A != prev.A)
+    flags |= trace_flag_a;
+  if (s.X != prev.X)
+    flags |= trace_flag_x;
+  if (s.Y != prev.Y)
+    flags |= trace_flag_y;
+  if (s.sp != prev.sp)
+    flags |= trace_flag_sp;
+  if (s.status != prev.status)
+    flags |= trace_flag_p;
+  if (bank != prev_bank)
+    flags |= trace_flag_bank;
+  if (cycle - prev_cycle != 1)
+    flags |= trace_flag_cycle;
+
+  uint8_t *p = c.data.data() + c.len;
+  *(p++) = flags;
+  *(p++) = opcode;
+  int16_t dpc = int16_t(uint16_t(s.pc - prev.pc));
+  put_varint(p, uint16_t(dpc << 1) ^ uint16_t(dpc >> 15));
+  if (flags & trace_flag_cycle)
+    put_varint(p, cycle - prev_cycle);
+  if (flags & trace_flag_a)
+    *(p++) = s.A;
+  if (flags & trace_flag_x)
+    *(p++) = s.X;
+  if (flags & trace_flag_y)
+    *(p++) = s.Y;
+  if (flags & trace_flag_sp)
+    *(p++) = s.sp;
+  if (flags & trace_flag_p)
+    *(p++) = s.status;
+  if (flags & trace_flag_bank)
+    put_varint(p, bank);
+  c.len = p - c.data.data();
+  c.records++;
+  total_records++;
+  prev = s;
+  prev_cycle = cycle;
+  prev_bank = bank;
+
+  if (c.len + max_record > chunk_size)
+    submit_chunk();
+  if (stop_after)
+    stop_recording();
+}
+
+} // namespace VTxx
@@ -0,0 +1,67 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <cstdint>
+#include <string>
+using namespace std;
+
+namespace mos6502 {
+class mos6502;
+};
+
+namespace VTxx {
+// Binary trace of main CPU instructions, buffered in memory and written to disk
+// by a background thread. Decode with tools/vttrace.
+//
+// The file starts with trace_magic, followed by chunks of a 32-bit little
+// endian payload length, a 32-bit record count and the payload. Each record is
+// delta coded against the previous one in the same chunk (all fields start at
+// zero in each chunk, so chunks decode independently):
+//   flags    1 byte, trace_flag_* bits for the fields that follow
+//   opcode   1 byte, as read from memory (before any scrambling)
+//   pc       zigzag varint of the 16-bit wrapped difference from the last PC
+//   cycle    varint difference from the last cycle, if trace_flag_cycle (else
+//            the difference is 1)
+//   A, X, Y, SP, P   1 byte each, only those whose flag is set
+//   bank     varint physical 8KB page (0 below 0x4000), if trace_flag_bank
+static const char trace_magic[8] = {'V', 'T', 'T', 'R', 'A', 'C', 'E', '1'};
+static const uint8_t trace_flag_a = 0x01, trace_flag_x = 0x02,
+                     trace_flag_y = 0x04, trace_flag_sp = 0x08,
+                     trace_flag_p = 0x10, trace_flag_bank = 0x20,
+                     trace_flag_cycle = 0x40;
+
+enum class TraceTrigger { NONE, PC, FRAME, WRITE };
+struct TraceCond {
+  TraceTrigger kind = TraceTrigger::NONE;
+  uint32_t value = 0;
+};
+// Parse "pc:ADDR", "frame:N" or "write:ADDR" (addresses in hex)
+bool trace_parse_cond(const string &s, TraceCond &c);
+
+// Start tracing to file once start is met (or immediately if NONE), until stop
+// is met or trace_close is called
+bool trace_open(const string &file, TraceCond start, TraceCond stop);
+void trace_close();
+
+// True while a trace file is open and not yet stopped
+extern bool trace_armed;
+void trace_record(mos6502::mos6502 *cpu, uint64_t cycle);
+void trace_event(TraceTrigger kind, uint32_t value);
+
+// Call before each main CPU instruction
+inline void trace_instr(mos6502::mos6502 *cpu, uint64_t cycle) {
+  if (trace_armed)
+    trace_record(cpu, cycle);
+}
+// Call at the start of each frame
+inline void trace_frame(uint32_t frame) {
+  if (trace_armed)
+    trace_event(TraceTrigger::FRAME, frame);
+}
+// Call on each register (0x2000 .. 0x21FF) write
+inline void trace_reg_write(uint16_t addr) {
+  if (trace_armed)
+    trace_event(TraceTrigger::WRITE, addr);
+}
+} // namespace VTxx
+
+#endif /* end of include guard: TRACE_H */
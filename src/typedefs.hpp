@@ -11,6 +11,13 @@ typedef void (*TimerCallback)(bool status);
 typedef uint8_t (*ReadHandler)(uint16_t addr);
 typedef void (*WriteHandler)(uint16_t addr, uint8_t value);
 
+// Called before an access to state shared with another thread
+typedef void (*SyncHandler)();
+
+// Called on an access to a watched address, see mmu_set_watch
+typedef void (*WatchHandler)(uint32_t addr, bool physical, bool write,
+                             uint8_t data);
+
 } // namespace VTxx
 
 #endif /* end of include guard: TYPEDEFS_H */
@@ -0,0 +1,148 @@
+#include "viewer.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+using namespace std;
+
+namespace VTxx {
+
+struct ViewerWindow {
+  SDL_Window *window = nullptr;
+  SDL_Renderer *renderer = nullptr;
+  SDL_Texture *texture = nullptr;
+  Uint32 id = 0;
+};
+static ViewerWindow windows[ppu_view_count];
+static const char *view_titles[ppu_view_count] = {
+    "Background 0", "Background 1", "Sprites", "Palettes (0x1C00, 0x1E00)",
+    "ROM tiles"};
+static PPUTileBrowse browse;
+
+static string tiles_title() {
+  char buf[100];
+  snprintf(buf, sizeof(buf),
+           "ROM tiles: segment %03X, %d bpp, %dx%d, palette %d (0x%04X)",
+           browse.seg, browse.bpp, browse.size, browse.size, browse.palette,
+           browse.pal1 ? 0x1C00 : 0x1E00);
+  return buf;
+}
+
+static void close_window(ViewerWindow &w) {
+  SDL_DestroyTexture(w.texture);
+  SDL_DestroyRenderer(w.renderer);
+  SDL_DestroyWindow(w.window);
+  w = ViewerWindow();
+}
+
+void viewer_toggle(PPUView v) {
+  ViewerWindow &w = windows[int(v)];
+  if (w.window != nullptr) {
+    close_window(w);
+    return;
+  }
+  int width, height;
+  ppu_view_size(v, width, height);
+  int scale = (width < 400) ? 2 : 1;
+  string title = (v == PPUView::TILES) ? tiles_title() : view_titles[int(v)];
+  w.window = SDL_CreateWindow(title.c_str(), SDL_WINDOWPOS_UNDEFINED,
+                              SDL_WINDOWPOS_UNDEFINED, width * scale,
+                              height * scale, 0);
+  if (w.window == nullptr) {
+    cerr << "Failed to create window: " << SDL_GetError() << endl;
+    return;
+  }
+  // No vsync, so that presenting several windows doesn't stall the frame loop
+  w.renderer = SDL_CreateRenderer(w.window, -1, SDL_RENDERER_ACCELERATED);
+  w.texture = SDL_CreateTexture(w.renderer, SDL_PIXELFORMAT_ARGB8888,
+                                SDL_TEXTUREACCESS_STREAMING, width, height);
+  w.id = SDL_GetWindowID(w.window);
+  ppu_view_set_tiles(browse);
+  ppu_view_invalidate(v);
+}
+
+void viewer_update() {
+  bool any_open = false;
+  for (const auto &w : windows)
+    any_open |= (w.window != nullptr);
+  if (!any_open)
+    return;
+  ppu_view_snapshot();
+  for (int i = 0; i < ppu_view_count; i++) {
+    ViewerWindow &w = windows[i];
+    if (w.window == nullptr)
+      continue;
+    PPUViewRect dirty;
+    const uint32_t *pixels = ppu_view_draw(PPUView(i), dirty);
+    if (dirty.w > 0) {
+      int width, height;
+      ppu_view_size(PPUView(i), width, height);
+      SDL_Rect rect = {dirty.x, dirty.y, dirty.w, dirty.h};
+      SDL_UpdateTexture(w.texture, &rect,
+                        pixels + (dirty.y * width + dirty.x), width * 4);
+    }
+    SDL_RenderClear(w.renderer);
+    SDL_RenderCopy(w.renderer, w.texture, nullptr, nullptr);
+    SDL_RenderPresent(w.renderer);
+  }
+}
+
+static void tiles_key(const SDL_KeyboardEvent &key) {
+  int step = (key.keysym.mod & KMOD_SHIFT) ? 16 : 1;
+  switch (key.keysym.scancode) {
+  case SDL_SCANCODE_PAGEUP:
+    browse.seg = (browse.seg - step) & 0xFFF;
+    break;
+  case SDL_SCANCODE_PAGEDOWN:
+    browse.seg = (browse.seg + step) & 0xFFF;
+    break;
+  case SDL_SCANCODE_B: {
+    static const int bpps[] = {2, 4, 6, 8, 16};
+    int i = find(bpps, bpps + 5, browse.bpp) - bpps;
+    browse.bpp = bpps[(i + 1) % 5];
+    break;
+  }
+  case SDL_SCANCODE_S:
+    browse.size = (browse.size == 8) ? 16 : 8;
+    break;
+  case SDL_SCANCODE_P:
+    browse.palette = (browse.palette + 1) % 16;
+    break;
+  case SDL_SCANCODE_L:
+    browse.pal1 = !browse.pal1;
+    break;
+  default:
+    return;
+  }
+  ppu_view_set_tiles(browse);
+  SDL_SetWindowTitle(windows[int(PPUView::TILES)].window,
+                     tiles_title().c_str());
+}
+
+bool viewer_event(const SDL_Event &ev) {
+  Uint32 id;
+  if (ev.type == SDL_WINDOWEVENT)
+    id = ev.window.windowID;
+  else if (ev.type == SDL_KEYDOWN || ev.type == SDL_KEYUP)
+    id = ev.key.windowID;
+  else
+    return false;
+  for (int i = 0; i < ppu_view_count; i++) {
+    ViewerWindow &w = windows[i];
+    if (w.window == nullptr || w.id != id)
+      continue;
+    if (ev.type == SDL_WINDOWEVENT && ev.window.event == SDL_WINDOWEVENT_CLOSE)
+      close_window(w);
+    else if (ev.type == SDL_KEYDOWN && PPUView(i) == PPUView::TILES)
+      tiles_key(ev.key);
+    return true;
+  }
+  return false;
+}
+
+void viewer_close_all() {
+  for (auto &w : windows)
+    if (w.window != nullptr)
+      close_window(w);
+}
+
+} // namespace VTxx
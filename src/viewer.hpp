@@ -0,0 +1,23 @@
+#ifndef VIEWER_H
+#define VIEWER_H
+#include "SDL2/SDL.h"
+#include "ppu.hpp"
+
+namespace VTxx {
+// Debug windows showing live PPU state (see ppu_view_draw). Call from the
+// thread that owns the SDL windows.
+//
+// The ROM tile window takes PgUp/PgDn to move by a segment (Shift for 16),
+// B to cycle bits per pixel, S to toggle 8x8/16x16, P to cycle the palette
+// bank and L to switch between the 0x1E00 and 0x1C00 palettes
+
+// Open the window for a view, or close it if already open
+void viewer_toggle(PPUView v);
+// Redraw the open windows from the current PPU state, once per frame
+void viewer_update();
+// Handle an event if it is for a viewer window, returning true if it was
+bool viewer_event(const SDL_Event &ev);
+void viewer_close_all();
+} // namespace VTxx
+
+#endif /* end of include guard: VIEWER_H */
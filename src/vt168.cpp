@@ -1,19 +1,31 @@
 #include "vt168.hpp"
 #include "6502/mos6502.hpp"
+#include "audio.hpp"
+#include "capture.hpp"
+#include "debug.hpp"
 #include "dma.hpp"
 #include "extalu.hpp"
 #include "input.hpp"
 #include "irq.hpp"
+#include "lockstep.hpp"
 #include "miwi2_input.hpp"
 #include "mmu.hpp"
 #include "ppu.hpp"
+#include "profiler.hpp"
 #include "scpu_mem.hpp"
+#include "spu.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 using namespace std;
 
@@ -25,6 +37,9 @@ static Timer *cpu_timer, *scpu_timer0, *scpu_timer1;
 static IRQController *cpu_irq, *scpu_irq;
 
 static DMACtrl *cpu_dma;
+static SPU *spu = nullptr;
+static float audio_volume = 1.0f;
+static ResampleMode audio_resampler = ResampleMode::SINC;
 
 static InputDev *inp;
 static MiWi2Input *mw2inp = nullptr;
@@ -44,12 +59,34 @@ static const vector<IRQVector> scpu_vectors = {
 };
 static int fcount = 0;
 static int last_fcount = 0;
+static uint64_t cpu_instrs = 0, scpu_instrs = 0, cpu_clocks = 0;
+// Stats are copied at each vblank so other threads can read them
+static VT168_Stats stats_snapshot;
+static mutex stats_mutex;
+static void update_stats_snapshot();
 
 chrono::system_clock::time_point last_update;
 
-void vt168_init(VT168_Platform plat, const std::string &rom) {
+static VT168_Region region = VT168_Region::PAL;
+static int cpu_ratio = 5;
+
+static void scpu_sync();
+static void scpu_update_state();
+static bool on_scpu_thread();
+static void scpu_defer_mailbox(uint8_t b);
+
+// Master clock is 6x the colour subcarrier
+static double master_clock_hz() {
+  return (region == VT168_Region::NTSC) ? 21477272.0 : 26601712.0;
+}
+
+void vt168_init(VT168_Platform plat, const std::string &rom,
+                VT168_Region rgn) {
+  region = rgn;
+  cpu_ratio = (region == VT168_Region::NTSC) ? 4 : 5;
   mmu_init();
   ppu_init();
+  ppu_set_ntsc(region == VT168_Region::NTSC);
   if (rom != "")
     load_rom(rom);
 
@@ -124,6 +161,15 @@ void vt168_init(VT168_Platform plat, const std::string &rom) {
     };
   }
 
+  spu = new SPU(master_clock_hz(), audio_get_rate(), audio_resampler);
+  spu->set_output(audio_volume, audio_resampler);
+  for (uint8_t a = 0x18; a <= 0x1B; a++) {
+    scpu_reg_read_fn[a] = [](uint16_t a) { return spu->read(a - 0x2118); };
+    scpu_reg_write_fn[a] = [](uint16_t a, uint8_t b) {
+      spu->write(a - 0x2118, b);
+    };
+  }
+
   inp = new InputDev();
 
   reg_read_fn[0x29] = [](uint16_t a) { return inp->read(0); };
@@ -134,19 +180,32 @@ void vt168_init(VT168_Platform plat, const std::string &rom) {
     reg_read_fn[0x0F] = [](uint16_t a) { return mw2inp->read(1); };
   }
 
+  reg_write_fn[0x06] = [](uint16_t a, uint8_t b) {
+    scpu_sync();
+    control_reg[0x06] = b;
+    scpu_update_state();
+  };
+
   reg_write_fn[0x1C] = [](uint16_t a, uint8_t b) {
+    scpu_sync();
     control_reg[0x1C] = b;
     scpu_irq->set_irq(3, get_bit(b, 4));
   };
 
+  // Reading the mailbox acknowledges the SCPU's IRQ, as the line is level
+  // sensitive and would otherwise be taken again after every RTI
   reg_read_fn[0x1C] = [](uint16_t a) {
+    scpu_sync();
+    cpu_irq->set_irq(2, false);
     return control_reg[0x1C];
-    cpu_irq->set_irq(3, false);
   };
 
   scpu_reg_write_fn[0x1C] = [](uint16_t a, uint8_t b) {
     scpu_control_reg[0x1c] = b;
-    cpu_irq->set_irq(2, get_bit(b, 4));
+    if (on_scpu_thread())
+      scpu_defer_mailbox(b);
+    else
+      cpu_irq->set_irq(2, get_bit(b, 4));
   };
 
   scpu_reg_read_fn[0x1C] = [](uint16_t a) {
@@ -162,36 +221,277 @@ void vt168_init(VT168_Platform plat, const std::string &rom) {
 
 const int reg_sys = 0x06;
 
-static void vt168_scpu_tick() {
-  if (!get_bit(control_reg[reg_sys], 5)) {
+// The SCPU is held in reset while bit 5 of reg_sys is clear, and halted while
+// bit 4 is clear. Rather than checking every clock, the state is updated when
+// the register changes, and the SCPU is reset once as it leaves reset
+static bool scpu_in_reset = true, scpu_running = false;
+
+static void scpu_update_state() {
+  bool in_reset = !get_bit(control_reg[reg_sys], 5);
+  if (scpu_in_reset && !in_reset)
     scpu->Reset();
-  } else if (get_bit(control_reg[reg_sys], 4)) {
+  scpu_in_reset = in_reset;
+  scpu_running = !in_reset && get_bit(control_reg[reg_sys], 4);
+}
+
+static void vt168_scpu_tick() {
+  if (scpu_running) {
     scpu->Run(1);
+    scpu_instrs++;
+  }
+  if (scpu_timer0->is_active())
+    scpu_timer0->tick();
+  if (scpu_timer1->is_active())
+    scpu_timer1->tick();
+}
+
+static inline void scpu_step() {
+  vt168_scpu_tick();
+  spu->tick();
+}
+
+// The SCPU can run on its own thread, up to one slice (a scanline) of master
+// clocks behind the main CPU. At each slice boundary the main thread waits for
+// the SCPU to finish the slice, applies what the SCPU deferred, and grants it
+// the clocks the main CPU has run since. Main CPU accesses to shared RAM, the
+// mailbox or the SCPU control register wait for the SCPU, step it up to the
+// main CPU's clock so the access sees the same state as without the thread,
+// and then run both in lockstep on the main thread for a while, as such
+// accesses tend to come in bursts
+static bool scpu_threaded = false;
+static bool scpu_lockstep = true;
+static thread scpu_thread;
+static mutex scpu_mutex;
+static condition_variable scpu_cv, scpu_idle_cv;
+// Iterations to spin before sleeping when waiting for the other thread, zero
+// on single core hosts where spinning only delays it
+static int scpu_spin = 0;
+static atomic<bool> slice_pending(false), scpu_quit(false);
+// Master clocks run by the main thread and by the SCPU, the clock the SCPU may
+// run up to in the current slice, and the master clock ending the slice
+static uint64_t master_clock = 0, scpu_clock = 0, scpu_grant = 0,
+                slice_end = 0;
+static uint64_t lockstep_until = 0;
+static const uint64_t lockstep_hold_slices = 8;
+// Mailbox writes made on the SCPU thread, applied at the next barrier
+static vector<uint8_t> deferred_mailbox;
+static thread_local bool is_scpu_thread = false;
+
+static uint64_t slice_clocks() { return 341 * cpu_ratio; }
+
+static bool on_scpu_thread() { return is_scpu_thread; }
+
+static void scpu_defer_mailbox(uint8_t b) { deferred_mailbox.push_back(b); }
+
+static void scpu_thread_fn() {
+  is_scpu_thread = true;
+  while (true) {
+    // Slices are short, so spin for a while before sleeping
+    for (int i = 0; i < scpu_spin && !slice_pending && !scpu_quit; i++)
+      this_thread::yield();
+    {
+      unique_lock<mutex> lk(scpu_mutex);
+      scpu_cv.wait(lk, [] { return slice_pending || scpu_quit; });
+    }
+    if (scpu_quit)
+      return;
+    while (scpu_clock < scpu_grant) {
+      scpu_step();
+      scpu_clock++;
+    }
+    {
+      lock_guard<mutex> lk(scpu_mutex);
+      slice_pending = false;
+    }
+    scpu_idle_cv.notify_one();
+  }
+}
+
+// Wait for the SCPU thread to finish its slice
+static void scpu_wait_idle() {
+  for (int i = 0; i < scpu_spin && slice_pending; i++)
+    this_thread::yield();
+  if (slice_pending) {
+    unique_lock<mutex> lk(scpu_mutex);
+    scpu_idle_cv.wait(lk, [] { return !slice_pending; });
+  }
+  for (uint8_t b : deferred_mailbox)
+    cpu_irq->set_irq(2, get_bit(b, 4));
+  deferred_mailbox.clear();
+}
+
+static void scpu_start_slice(uint64_t until) {
+  scpu_grant = until;
+  {
+    lock_guard<mutex> lk(scpu_mutex);
+    slice_pending = true;
+  }
+  scpu_cv.notify_one();
+}
+
+static void scpu_sync() {
+  if (!scpu_threaded)
+    return;
+  if (!scpu_lockstep) {
+    scpu_wait_idle();
+    while (scpu_clock < master_clock) {
+      scpu_step();
+      scpu_clock++;
+    }
+    scpu_lockstep = true;
   }
-  scpu_timer0->tick();
-  scpu_timer1->tick();
+  lockstep_until = master_clock + lockstep_hold_slices * slice_clocks();
 }
 
+static inline void scpu_advance() {
+  master_clock++;
+  if (scpu_lockstep) {
+    scpu_step();
+    scpu_clock++;
+    if (scpu_threaded && master_clock >= lockstep_until) {
+      scpu_lockstep = false;
+      slice_end = master_clock + slice_clocks();
+    }
+  } else if (master_clock >= slice_end) {
+    scpu_wait_idle();
+    scpu_start_slice(master_clock);
+    slice_end = master_clock + slice_clocks();
+  }
+}
+
+void vt168_set_scpu_thread(bool enabled) {
+  if (enabled == scpu_threaded)
+    return;
+  if (enabled) {
+    scpu_quit = false;
+    scpu_spin = (thread::hardware_concurrency() > 1) ? 1000 : 0;
+    scpu_thread = thread(scpu_thread_fn);
+    scpu_threaded = true;
+    mmu_set_shared_ram_hook(scpu_sync);
+  } else {
+    scpu_sync();
+    mmu_set_shared_ram_hook(nullptr);
+    scpu_threaded = false;
+    {
+      lock_guard<mutex> lk(scpu_mutex);
+      scpu_quit = true;
+    }
+    scpu_cv.notify_one();
+    scpu_thread.join();
+  }
+}
+
+void vt168_set_cpu_cache(bool enabled, bool check) {
+  if (enabled)
+    cpu->EnableDecodeCache(&code_gen, 0x4000, check);
+  else
+    cpu->DisableDecodeCache();
+}
+
+void vt168_start_lockstep() { lockstep_start(cpu); }
+
+bool vt168_start_debugger(const string &path) { return debug_open(path, cpu); }
+
+bool vt168_start_capture(const string &path) {
+  return capture_open(path, 256, 240, vt168_get_frame_rate(),
+                      audio_get_rate());
+}
+
+void vt168_stop() { vt168_set_scpu_thread(false); }
+
 static void vt168_cpu_tick() {
   // cout << "PC: " << va_to_str(cpu->GetPC()) << endl;
-  if (!cpu_dma->is_busy())
-    cpu->Run(1);
+  if (cpu_dma->is_busy()) {
+    cpu_dma->tick();
+  } else {
+    debug_instr(cpu->GetPC());
+    prof_instr(cpu->GetPC());
+    trace_instr(cpu, cpu_clocks);
+    if (lockstep_enabled)
+      lockstep_step();
+    else
+      cpu->Run(1);
+    cpu_instrs++;
+  }
   cpu_timer->tick();
+  cpu_clocks++;
 }
 
-static int cpu_ratio = 5; // set to 4 for NTSC
 static int cpu_div = 0;
 static bool last_vblank = false;
 
+void vt168_set_audio_output(float volume, ResampleMode mode) {
+  audio_volume = volume;
+  audio_resampler = mode;
+  if (spu != nullptr)
+    spu->set_output(volume, mode);
+}
+
+double vt168_get_frame_rate() {
+  return master_clock_hz() / cpu_ratio / ppu_get_frame_ticks();
+}
+
+static bool fps_report = true;
+void vt168_set_fps_report(bool enabled) { fps_report = enabled; }
+
+// Subsystem timing is sampled once every timing_period master clocks, so that
+// reading the clock doesn't dominate what is being measured
+static bool timing_en = false;
+static const uint64_t timing_period = 64;
+static VT168_Timing timing;
+// Cost of reading the clock, subtracted from each sample
+static double timing_overhead_ns = 0;
+
+void vt168_set_timing(bool enabled) {
+  timing_en = enabled;
+  if (enabled) {
+    double best = 1e9;
+    for (int i = 0; i < 1000; i++) {
+      auto a = chrono::steady_clock::now();
+      auto b = chrono::steady_clock::now();
+      best = min(best,
+                 double(chrono::duration_cast<chrono::nanoseconds>(b - a)
+                            .count()));
+    }
+    timing_overhead_ns = best;
+  }
+}
+VT168_Timing vt168_get_timing() { return timing; }
+
+static inline chrono::steady_clock::time_point timing_now(bool sample) {
+  return sample ? chrono::steady_clock::now()
+                : chrono::steady_clock::time_point();
+}
+
+static inline double timing_ns(chrono::steady_clock::time_point a,
+                               chrono::steady_clock::time_point b) {
+  double ns = chrono::duration_cast<chrono::nanoseconds>(b - a).count() -
+              timing_overhead_ns;
+  return double(timing_period) * max(ns, 0.0);
+}
+
 bool vt168_tick() {
-  vt168_scpu_tick();
+  timing.master_clocks++;
+  bool sample = timing_en && (timing.master_clocks % timing_period) == 0;
+  auto t0 = timing_now(sample);
+  scpu_advance();
+  auto t1 = timing_now(sample);
+  if (sample)
+    timing.scpu_ns += timing_ns(t0, t1);
   cpu_div++;
   bool is_vblank = false;
 
   if (cpu_div == cpu_ratio) {
     cpu_div = 0;
+    timing.cpu_clocks++;
     vt168_cpu_tick();
+    auto t2 = timing_now(sample);
     ppu_tick();
+    if (sample) {
+      auto t3 = timing_now(sample);
+      timing.cpu_ns += timing_ns(t1, t2);
+      timing.ppu_ns += timing_ns(t2, t3);
+    }
 
     if (ppu_is_vblank() && !last_vblank) {
       if (mw2inp != nullptr) {
@@ -208,9 +508,20 @@ bool vt168_tick() {
       if (cpu->GetPC() <= 0x104)
         assert(false);*/
       fcount++;
+      trace_frame(fcount);
+      debug_frame();
+      timing.frames++;
+      // Bring the SCPU to a consistent state for the frame boundary
+      if (scpu_threaded && !scpu_lockstep)
+        scpu_wait_idle();
+      spu->flush();
+      update_stats_snapshot();
       if (ppu_nmi_enabled()) {
         // cout << "-- NMI --" << endl;
-        cpu->NMI();
+        if (lockstep_enabled)
+          lockstep_nmi();
+        else
+          cpu->NMI();
         if (get_bit(scpu_control_reg[0x1C], 1))
           scpu->NMI();
       }
@@ -220,7 +531,8 @@ bool vt168_tick() {
             double(fcount - last_fcount) /
             (chrono::duration<double>(chrono::system_clock::now() - last_update)
                  .count());
-        cout << "speed = " << dec << fps << "fps" << endl;
+        if (fps_report)
+          cout << "speed = " << dec << fps << "fps" << endl;
         last_fcount = fcount;
         last_update = chrono::system_clock::now();
       }
@@ -233,6 +545,24 @@ bool vt168_tick() {
   return is_vblank;
 }
 
+static void update_stats_snapshot() {
+  lock_guard<mutex> lk(stats_mutex);
+  VT168_Stats &st = stats_snapshot;
+  st.frames = fcount;
+  st.cpu_instrs = cpu_instrs;
+  st.scpu_instrs = scpu_instrs;
+  copy(mmio_read_count, mmio_read_count + 512, st.mmio_reads);
+  copy(mmio_write_count, mmio_write_count + 512, st.mmio_writes);
+  st.dma_bytes = cpu_dma->bytes_moved;
+  st.dma_stall_cycles = cpu_dma->stall_cycles;
+  st.ppu = ppu_get_stats();
+}
+
+VT168_Stats vt168_get_stats() {
+  lock_guard<mutex> lk(stats_mutex);
+  return stats_snapshot;
+}
+
 void vt168_process_event(SDL_Event *ev) {
   inp->process_event(ev);
   if (mw2inp != nullptr) {
@@ -241,11 +571,16 @@ void vt168_process_event(SDL_Event *ev) {
 }
 
 void vt168_reset() {
+  scpu_sync();
   mmu_reset();
   ppu_reset();
   cpu_dma->reset();
+  spu->reset();
   scpu->Reset();
+  scpu_update_state();
   cpu->Reset();
+  if (lockstep_enabled)
+    lockstep_resync();
 }
 
 }; // namespace VTxx
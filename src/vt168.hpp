@@ -2,16 +2,66 @@
 #define VT168_H
 
 #include "SDL2/SDL.h"
+#include "mixer.hpp"
+#include "ppu.hpp"
 #include <cstdint>
 #include <string>
 namespace VTxx {
 
 enum class VT168_Platform { VT168_BASE, VT168_MIWI2 };
+enum class VT168_Region { PAL, NTSC };
 
-void vt168_init(VT168_Platform plat, const std::string &rom);
+void vt168_init(VT168_Platform plat, const std::string &rom,
+                VT168_Region region = VT168_Region::PAL);
+// Emulated frames per second for the region set at init
+double vt168_get_frame_rate();
+// Sound output volume (1.0 is unity) and resampler, may be set before init
+void vt168_set_audio_output(float volume, ResampleMode mode);
 bool vt168_tick();
 void vt168_process_event(SDL_Event *ev);
 void vt168_reset();
+// Run the SCPU on its own thread, after init. vt168_stop joins the thread and
+// must be called before exit if it was enabled
+void vt168_set_scpu_thread(bool enabled);
+// Run main CPU code in ROM space from a predecoded instruction cache, after
+// init. If check is set every cached instruction is verified against the bus
+void vt168_set_cpu_cache(bool enabled, bool check = false);
+// Validate the main CPU against a reference core after every instruction, see
+// lockstep.hpp. Call after init and any other CPU options
+void vt168_start_lockstep();
+// Serve the debugger (see debug.hpp) on a Unix socket at path, after init.
+// debug_close must be called before joining the emulator thread
+bool vt168_start_debugger(const std::string &path);
+// Record video and audio to path (see capture.hpp), after init.
+// capture_close must be called after vt168_stop and ppu_stop
+bool vt168_start_capture(const std::string &path);
+void vt168_stop();
+
+// Host time spent per subsystem, sampled when enabled by vt168_set_timing
+struct VT168_Timing {
+  uint64_t master_clocks = 0;
+  uint64_t cpu_clocks = 0;
+  uint64_t frames = 0;
+  double scpu_ns = 0, cpu_ns = 0, ppu_ns = 0;
+};
+
+// Performance counters, all totals since init, updated at each vblank
+struct VT168_Stats {
+  uint64_t frames = 0;
+  uint64_t cpu_instrs = 0, scpu_instrs = 0;
+  // Indexed by address - 0x2000
+  uint64_t mmio_reads[512], mmio_writes[512];
+  uint64_t dma_bytes = 0;
+  uint64_t dma_stall_cycles = 0; // CPU clocks stalled by DMA
+  PPUStats ppu;
+};
+
+VT168_Stats vt168_get_stats();
+
+void vt168_set_timing(bool enabled);
+VT168_Timing vt168_get_timing();
+// Enable or disable the periodic speed printout
+void vt168_set_fps_report(bool enabled);
 
 }; // namespace VTxx
 
@@ -0,0 +1,273 @@
+// Convert OpenVTx captures (see src/capture.hpp) to video and WAV files
+#include "../src/capture.hpp"
+#include "../src/framewriter.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+struct Options {
+  string video, wav;
+  uint64_t from = 0, to = UINT64_MAX;
+};
+
+struct CaptureInfo {
+  int width = 0, height = 0;
+  double fps = 0;
+  uint32_t audio_rate = 0, key_interval = 0;
+};
+
+static const size_t header_size = 24;
+
+static void usage() {
+  cerr << "Usage: vtcap file [options]" << endl
+       << "  --video FILE      write frames in the format given by the "
+          "extension"
+       << endl
+       << "                    (y4m, rgb, or numbered png or bmp files)" << endl
+       << "  --wav FILE        write all of the audio" << endl
+       << "  --range LO[-HI]   only write these frames to --video" << endl
+       << "With no options, print a summary" << endl;
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes) {
+  uint64_t x = 0;
+  for (int i = 0; i < bytes; i++)
+    x |= uint64_t(p[i]) << (8 * i);
+  return x;
+}
+
+static void put_le(FILE *f, uint32_t x, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    fputc((x >> (8 * i)) & 0xFF, f);
+}
+
+static bool lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                           size_t dst_len) {
+  const uint8_t *end = src + len;
+  size_t op = 0;
+  while (src < end) {
+    uint8_t token = *(src++);
+    size_t lit = token >> 4, match = token & 0xF;
+    if (lit == 15) {
+      uint8_t b;
+      do {
+        if (src >= end)
+          return false;
+        b = *(src++);
+        lit += b;
+      } while (b == 255);
+    }
+    if (lit > size_t(end - src) || lit > dst_len - op)
+      return false;
+    memcpy(dst + op, src, lit);
+    src += lit;
+    op += lit;
+    if (src == end)
+      break;
+    if (end - src < 2)
+      return false;
+    size_t offset = src[0] | (src[1] << 8);
+    src += 2;
+    if (match == 15) {
+      uint8_t b;
+      do {
+        if (src >= end)
+          return false;
+        b = *(src++);
+        match += b;
+      } while (b == 255);
+    }
+    match += 4;
+    if (offset == 0 || offset > op || match > dst_len - op)
+      return false;
+    // Matches may overlap their own output
+    for (size_t i = 0; i < match; i++, op++)
+      dst[op] = dst[op - offset];
+  }
+  return op == dst_len;
+}
+
+// Find the offset of the last key frame at or before frame, if indexed
+static bool find_key(ifstream &in, uint64_t frame, uint64_t &offset) {
+  uint8_t trailer[16];
+  in.seekg(-16, ios::end);
+  if (!in.read(reinterpret_cast<char *>(trailer), 16) ||
+      memcmp(trailer + 8, capture_index_magic, 8) != 0)
+    return false;
+  in.seekg(get_le(trailer, 8));
+  uint8_t hdr[8];
+  if (!in.read(reinterpret_cast<char *>(hdr), 8) || memcmp(hdr, "INDX", 4))
+    return false;
+  vector<uint8_t> index(get_le(hdr + 4, 4));
+  if (!in.read(reinterpret_cast<char *>(index.data()), index.size()))
+    return false;
+  bool found = false;
+  for (size_t i = 0; i + 12 <= index.size(); i += 12) {
+    if (get_le(&index[i], 4) > frame)
+      break;
+    offset = get_le(&index[i + 4], 8);
+    found = true;
+  }
+  return found;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  Options opt;
+  try {
+    for (int i = 2; i < argc; i++) {
+      string arg = argv[i];
+      if (arg == "--video" && (i + 1) < argc) {
+        opt.video = argv[++i];
+      } else if (arg == "--wav" && (i + 1) < argc) {
+        opt.wav = argv[++i];
+      } else if (arg == "--range" && (i + 1) < argc) {
+        string s = argv[++i];
+        size_t dash = s.find('-');
+        opt.from = stoull(s.substr(0, dash));
+        opt.to = (dash == string::npos) ? opt.from : stoull(s.substr(dash + 1));
+      } else {
+        usage();
+        return 2;
+      }
+    }
+  } catch (exception &e) {
+    usage();
+    return 2;
+  }
+
+  ifstream in(argv[1], ios::binary);
+  uint8_t hdr[header_size];
+  if (!in.read(reinterpret_cast<char *>(hdr), header_size) ||
+      memcmp(hdr, capture_magic, 8) != 0) {
+    cerr << "Not a capture file: " << argv[1] << endl;
+    return 1;
+  }
+  CaptureInfo info;
+  info.width = get_le(hdr + 8, 2);
+  info.height = get_le(hdr + 10, 2);
+  info.fps = get_le(hdr + 12, 4) / 1000.0;
+  info.audio_rate = get_le(hdr + 16, 4);
+  info.key_interval = get_le(hdr + 20, 4);
+
+  FrameWriter writer;
+  FrameFormat fmt;
+  if (!opt.video.empty()) {
+    if (!frame_format_from_name(opt.video, fmt)) {
+      cerr << "Unknown video format: " << opt.video << endl;
+      return 2;
+    }
+    if (!writer.open_sequence(opt.video, fmt, info.width, info.height,
+                              info.fps))
+      return 1;
+  }
+  FILE *wav = nullptr;
+  if (!opt.wav.empty()) {
+    wav = fopen(opt.wav.c_str(), "wb");
+    if (wav == nullptr) {
+      cerr << "Failed to open " << opt.wav << endl;
+      return 1;
+    }
+    // Sizes are filled in at the end
+    fwrite("RIFF\0\0\0\0WAVEfmt ", 1, 16, wav);
+    put_le(wav, 16, 4);
+    put_le(wav, 1, 2); // PCM
+    put_le(wav, 2, 2);
+    put_le(wav, info.audio_rate, 4);
+    put_le(wav, info.audio_rate * 4, 4);
+    put_le(wav, 4, 2);
+    put_le(wav, 16, 2);
+    fwrite("data\0\0\0\0", 1, 8, wav);
+  }
+
+  // Only video output can start from a key frame, audio needs everything
+  uint64_t offset = header_size;
+  if (!opt.video.empty() && wav == nullptr && opt.from > 0 &&
+      !find_key(in, opt.from, offset))
+    offset = header_size;
+  in.clear();
+  in.seekg(offset);
+
+  size_t frame_size = size_t(info.width) * info.height;
+  vector<uint32_t> frame(frame_size), delta(frame_size);
+  vector<uint8_t> payload;
+  uint64_t frames = 0, keys = 0, audio = 0, video_bytes = 0;
+  bool have_key = false, done = false;
+  uint8_t chunk[8];
+  while (!done && in.read(reinterpret_cast<char *>(chunk), 8)) {
+    string tag(reinterpret_cast<char *>(chunk), 4);
+    payload.resize(get_le(chunk + 4, 4));
+    if (!in.read(reinterpret_cast<char *>(payload.data()), payload.size())) {
+      cerr << "Truncated chunk, capture was not closed" << endl;
+      break;
+    }
+    if (tag == "VKEY" || tag == "VDLT") {
+      if (payload.size() < 4) {
+        cerr << "Corrupt frame" << endl;
+        return 1;
+      }
+      uint64_t n = get_le(payload.data(), 4);
+      frames++;
+      keys += (tag == "VKEY");
+      video_bytes += payload.size() + 8;
+      if (opt.video.empty())
+        continue;
+      if (n > opt.to && wav == nullptr) {
+        done = true;
+        continue;
+      }
+      if (!lz4_decompress(payload.data() + 4, payload.size() - 4,
+                          reinterpret_cast<uint8_t *>(delta.data()),
+                          frame_size * 4)) {
+        cerr << "Corrupt frame " << n << endl;
+        return 1;
+      }
+      if (tag == "VKEY") {
+        frame.swap(delta);
+        have_key = true;
+      } else {
+        for (size_t i = 0; i < frame_size; i++)
+          frame[i] ^= delta[i];
+      }
+      if (have_key && n >= opt.from && n <= opt.to)
+        writer.write_frame(frame.data(), n);
+    } else if (tag == "AUDI") {
+      audio += payload.size() / 4;
+      if (wav != nullptr)
+        fwrite(payload.data(), 1, payload.size(), wav);
+    } else if (tag == "INDX") {
+      done = true;
+    }
+  }
+
+  if (wav != nullptr) {
+    fseek(wav, 4, SEEK_SET);
+    put_le(wav, 36 + audio * 4, 4);
+    fseek(wav, 40, SEEK_SET);
+    put_le(wav, audio * 4, 4);
+    fclose(wav);
+  }
+  writer.close_sequence();
+  if (opt.video.empty() && wav == nullptr) {
+    printf("%dx%d at %.3f fps, audio %u Hz stereo\n", info.width, info.height,
+           info.fps, info.audio_rate);
+    printf("%llu frames (%.2f s), %llu key frames every %u\n",
+           (unsigned long long)frames, frames / info.fps,
+           (unsigned long long)keys, info.key_interval);
+    printf("%llu audio samples (%.2f s)\n", (unsigned long long)audio,
+           info.audio_rate ? double(audio) / info.audio_rate : 0.0);
+    if (frames > 0)
+      printf("Video %.1f KB per frame, %.1f:1 compression\n",
+             video_bytes / 1024.0 / frames,
+             double(frames * frame_size * 4) / video_bytes);
+  }
+  return 0;
+}
@@ -0,0 +1,175 @@
+// Decode and filter OpenVTx instruction traces (see src/trace.hpp)
+#include "../src/trace.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+struct Record {
+  uint64_t cycle;
+  uint32_t bank;
+  uint16_t pc;
+  uint8_t opcode, a, x, y, sp, p;
+};
+
+struct Filter {
+  uint32_t pc_lo = 0, pc_hi = 0xFFFF;
+  int64_t bank = -1;
+  int opcode = -1;
+  uint64_t cycle_lo = 0, cycle_hi = UINT64_MAX;
+  uint64_t limit = UINT64_MAX;
+  bool count_only = false;
+};
+
+static void usage() {
+  cerr << "Usage: vttrace file [options]" << endl
+       << "  --pc LO[-HI]      only instructions with PC in range (hex)" << endl
+       << "  --bank N          only instructions in physical 8KB page N (hex)"
+       << endl
+       << "  --opcode XX       only this opcode (hex)" << endl
+       << "  --cycles LO-HI    only instructions in this cycle range" << endl
+       << "  --limit N         stop after printing N instructions" << endl
+       << "  --count           print only the number of matches" << endl;
+}
+
+static void parse_range(const string &s, uint64_t &lo, uint64_t &hi,
+                        int base) {
+  size_t dash = s.find('-');
+  lo = stoull(s.substr(0, dash), nullptr, base);
+  hi = (dash == string::npos) ? lo : stoull(s.substr(dash + 1), nullptr, base);
+}
+
+static bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *(p++);
+    v |= uint64_t(b & 0x7F) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static bool matches(const Record &r, const Filter &f) {
+  return r.pc >= f.pc_lo && r.pc <= f.pc_hi &&
+         (f.bank < 0 || r.bank == uint32_t(f.bank)) &&
+         (f.opcode < 0 || r.opcode == f.opcode) && r.cycle >= f.cycle_lo &&
+         r.cycle <= f.cycle_hi;
+}
+
+static void print(const Record &r) {
+  const char *flags = "NV-BDIZC";
+  char p[9];
+  for (int i = 0; i < 8; i++)
+    p[i] = (r.p & (0x80 >> i)) ? flags[i] : '.';
+  p[8] = 0;
+  printf("%12llu  %03X:%04X  %02X  A=%02X X=%02X Y=%02X SP=%02X P=%s\n",
+         (unsigned long long)r.cycle, r.bank, r.pc, r.opcode, r.a, r.x, r.y,
+         r.sp, p);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  Filter f;
+  try {
+    for (int i = 2; i < argc; i++) {
+      string arg = argv[i];
+      uint64_t lo, hi;
+      if (arg == "--pc" && (i + 1) < argc) {
+        parse_range(argv[++i], lo, hi, 16);
+        f.pc_lo = lo;
+        f.pc_hi = hi;
+      } else if (arg == "--bank" && (i + 1) < argc) {
+        f.bank = stoll(argv[++i], nullptr, 16);
+      } else if (arg == "--opcode" && (i + 1) < argc) {
+        f.opcode = stoi(argv[++i], nullptr, 16);
+      } else if (arg == "--cycles" && (i + 1) < argc) {
+        parse_range(argv[++i], f.cycle_lo, f.cycle_hi, 10);
+      } else if (arg == "--limit" && (i + 1) < argc) {
+        f.limit = stoull(argv[++i]);
+      } else if (arg == "--count") {
+        f.count_only = true;
+      } else {
+        usage();
+        return 2;
+      }
+    }
+  } catch (exception &e) {
+    usage();
+    return 2;
+  }
+
+  ifstream in(argv[1], ios::binary);
+  char magic[8];
+  if (!in.read(magic, 8) || memcmp(magic, trace_magic, 8) != 0) {
+    cerr << "Not a trace file: " << argv[1] << endl;
+    return 1;
+  }
+  uint64_t shown = 0, total = 0;
+  vector<uint8_t> buf;
+  uint8_t hdr[8];
+  while (shown < f.limit && in.read(reinterpret_cast<char *>(hdr), 8)) {
+    uint32_t len = 0, records = 0;
+    for (int i = 0; i < 4; i++) {
+      len |= uint32_t(hdr[i]) << (8 * i);
+      records |= uint32_t(hdr[4 + i]) << (8 * i);
+    }
+    buf.resize(len);
+    if (!in.read(reinterpret_cast<char *>(buf.data()), len)) {
+      cerr << "Truncated chunk" << endl;
+      return 1;
+    }
+    Record r;
+    memset(&r, 0, sizeof(r));
+    const uint8_t *p = buf.data(), *end = buf.data() + len;
+    for (uint32_t n = 0; n < records && shown < f.limit; n++) {
+      uint64_t v;
+      if (end - p < 2) {
+        cerr << "Corrupt chunk" << endl;
+        return 1;
+      }
+      uint8_t flags = *(p++);
+      r.opcode = *(p++);
+      if (!get_varint(p, end, v))
+        return 1;
+      int16_t dpc = int16_t((v >> 1) ^ (0 - (v & 1)));
+      r.pc = uint16_t(r.pc + dpc);
+      if (flags & trace_flag_cycle) {
+        if (!get_varint(p, end, v))
+          return 1;
+        r.cycle += v;
+      } else {
+        r.cycle++;
+      }
+      uint8_t *regs[5] = {&r.a, &r.x, &r.y, &r.sp, &r.p};
+      for (int i = 0; i < 5; i++) {
+        if (flags & (1 << i)) {
+          if (p >= end)
+            return 1;
+          *regs[i] = *(p++);
+        }
+      }
+      if (flags & trace_flag_bank) {
+        if (!get_varint(p, end, v))
+          return 1;
+        r.bank = uint32_t(v);
+      }
+      total++;
+      if (matches(r, f)) {
+        shown++;
+        if (!f.count_only)
+          print(r);
+      }
+    }
+  }
+  if (f.count_only)
+    cout << shown << " of " << total << " instructions" << endl;
+  return 0;
+}